@@ -0,0 +1,23 @@
+/* See LICENSE file for copyright and license details. */
+
+/* An item catalog is a CatHdr followed by the tables it points to, each
+ * starting at a multiple of 8 bytes:
+ *   text   the items, each terminated by a NUL
+ *   off    uint64_t offset of each item in text
+ *   len    uint32_t length of each item
+ *   mask   uint64_t character classes of each item, see strmask()
+ * Numbers are in the byte order of the machine that wrote it, readers
+ * reject a catalog of another order or version. */
+
+#define CATMAGIC    "dmenucat"
+#define CATVERSION  1
+#define CATORDER    0x01020304
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t order;
+	uint64_t nitems;
+	uint64_t textoff, textlen;
+	uint64_t offoff, lenoff, maskoff;
+} CatHdr;
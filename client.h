@@ -0,0 +1,7 @@
+/* See LICENSE file for copyright and license details. */
+
+/* A dmenu_client request is the values of these variables, the working
+ * directory and the options, each ended by a NUL, with the client's
+ * stdin, stdout and stderr attached.  A dmenu -D server warmed up with
+ * other values of them hangs up, so the client runs dmenu itself. */
+static const char *clientenv[] = { "DISPLAY", "LC_ALL", "LC_CTYPE", "LANG" };
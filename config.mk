@@ -16,10 +16,12 @@ FREETYPEINC = /usr/include/freetype2
 
 # includes and libs
 INCS = -I${X11INC} -I${FREETYPEINC}
-LIBS = -L${X11LIB} -lX11 ${FREETYPELIBS} -lm
+LIBS = -L${X11LIB} -lX11 ${FREETYPELIBS} -lm -lpthread
 
 # flags
 CPPFLAGS = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_XOPEN_SOURCE=700 -D_POSIX_C_SOURCE=200809L -DVERSION=\"${VERSION}\"
+# wait for the X server after every frame instead of only flushing (uncomment)
+#CPPFLAGS += -DSYNCFRAMES
 CFLAGS   = -std=c99 -pedantic -Wall -Os -march=native ${INCS} ${CPPFLAGS}
 LDFLAGS  = -s ${LIBS}
 
@@ -1,26 +1,64 @@
 /* See LICENSE file for copyright and license details. */
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <locale.h>
-#include <math.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
 #include <X11/Xutil.h>
 #include <X11/Xft/Xft.h>
 
+#include "catalog.h"
+#include "client.h"
 #include "drw.h"
+#include "pool.h"
 #include "util.h"
 #include "utf8.h"
 
 /* macros TODO: get rid of this */
 #define TEXTW(X)              (drw_fontset_getwidth(drw, (X)) + lrpad)
+#define ITEXT(I)              (blob + itemoff[(I)])
+#define ISOUT(I)              (itemout[(I) / 64] >> ((I) % 64) & 1)
+
+#define STREAMCHUNK           (1 << 20) /* bytes read before re-matching */
+#define PARMIN                (1 << 15) /* candidates worth splitting across threads */
+#define RANKMIN               256       /* fuzzy matches sorted at a time */
+#define ARENASIZ              (1 << 20) /* initial size of the text blob */
+#define FREQSAMPLE            4096      /* items sampled for byte frequencies */
+#define HISTSLOTS             4096      /* picks remembered by -H */
+#define HISTPROBE             16        /* slots a pick may be stored in */
+#define HISTVERSION           1
+#define BOOSTMAX              128       /* most a history can add to a score */
+#define FUZZYCELLS            (1 << 14) /* largest alignment table, else greedy */
+#define FUZZYALIGNMAX         (1 << 15) /* most matches aligned per query, else greedy */
+#define ALIGNMIN              (1 << 9)  /* alignments worth splitting across threads */
+
+/* fuzzy alignment scores, per matched byte */
+#define SCOREMATCH            16
+#define SCOREGAPSTART         -3
+#define SCOREGAPEXT           -1
+#define BONUSWHITE            10        /* after whitespace or at the start */
+#define BONUSSLASH            9         /* after a path separator */
+#define BONUSBOUNDARY         8         /* after other punctuation */
+#define BONUSCAMEL            7         /* lower to upper case, or to a digit */
+#define BONUSCONSEC           4         /* least bonus in a consecutive run */
+#define SCORENONE             (INT32_MIN / 2)
 
 enum {
 	SchemeNorm, // normal colorscheme
@@ -30,8 +68,14 @@ enum {
 	SchemeLast,
 };
 
+enum { ByteWhite, ByteSlash, BytePunct, ByteLower, ByteUpper, ByteDigit, ByteOther,
+       ByteLast }; /* classes of bytes for fuzzy bonuses */
+
 enum {                        // refer to hasharg()
+	CatalogOpt = 2,           // -C
+	DaemonOpt = 3,            // -D
 	FuzzyMatchingOpt = 5,     // -F
+	HistoryOpt = 7,           // -H
 	OverrideRedirectOpt = 14, // -O
 	BottomOfScreenOpt = 33,   // -b
 	FastOpt = 37,             // -f
@@ -39,6 +83,8 @@ enum {                        // refer to hasharg()
 	CaseOpt = 40,             // -i
 	LinesOpt = 43,            // -l
 	PromptOpt = 47,           // -p
+	StreamOpt = 50,           // -s
+	ThreadsOpt = 51,          // -t
 	WidthOpt = 54,            // -w
 	XOffsetOpt = 55,          // -x
 	YOffsetOpt = 56,          // -y
@@ -50,32 +96,69 @@ enum {                        // refer to hasharg()
 	FontOpt = 127,            // -fn
 };
 
-struct item {
-	char *text;
-	struct item *left, *right;
-	int out;
-	double distance;
+/* fuzzy results of a query, later queries extending it only rescan these */
+struct fuzzylevel {
+	size_t *cand;   /* indices into items */
+	size_t n;
+	size_t nitems;  /* items read when the level was built */
+	int textlen;
+};
+
+/* results of one slice of a scan, item indices by class */
+struct slice {
+	size_t *out[4];
+	size_t nout[4], sz[4];
+	int32_t *dp;    /* fuzzy alignment rows and query positions */
+	size_t dpsz;
+};
+
+/* the -H file, a table of picks mapped in place */
+struct histhdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t nslots;
+};
+
+struct histslot {
+	uint64_t hash;  /* of the text picked, 0 when free */
+	uint32_t count;
+	uint32_t last;  /* hours since the epoch */
 };
 
 /* function prototypes */
 static void fuzzymatch(void);
 static void match(void);
 static void cleanup(void);
+static void leave(int);
 static void calcoffsets(void);
 static void drawmenu(void);
+static void createwin(void);
 static void setup(void);
+static void warmup(void);
+static void serve(void);
+static void parseargs(int, char *[]);
 static void grabfocus(void);
 static void grabkeyboard(void);
 static void paste(void);
+static void rankmore(size_t);
+static void openhist(void);
+static void readcatalog(void);
 static void readstdin(void);
+static void readstream(void);
+static void measureitems(size_t);
 static void run(void);
 
-static void appenditem(struct item *, struct item **, struct item **);
+static void additem(size_t, size_t);
+static ssize_t ingest(int);
+static int mapstdin(void);
 static void insert(const char *, ssize_t);
 static void keypress(XKeyEvent *);
 
-static int drawitem(struct item *, int, int, int);
+static int drawitem(size_t, int, int, int);
+static unsigned int itemw(size_t);
+static unsigned int arroww(const char *);
 static int compare_distance(const void *, const void *);
+static void classifybytes(void);
 static size_t nextrune(int);
 
 /* global variables */
@@ -83,15 +166,71 @@ static char text[BUFSIZ] = "";
 static size_t cursor;
 
 static const char *prompt;
+static const char *catalog;                // items are mapped from this file
+static const char *histfile;               // picks are remembered in this file
+static const char *sockpath;               // menus are served on this socket
+static int clientfd = -1;                  // -D: where the exit status goes
+static struct histslot *hist;
+static uint32_t histnow;                   // hours since the epoch
 
 static uint_fast16_t menux, menuy, menuw, menuh, menuwusr;
 static uint_fast16_t inputw, promptw;
 static uint_fast16_t lineh;
 static uint_fast16_t lrpad;
-
-static struct item *items;
-static struct item *matches, *matchend;
-static struct item *prev, *curr, *next, *sel;
+static unsigned int widthgen;              // fontset the cached widths belong to
+static unsigned int larroww, rarroww;      // cached widths of "<" and ">"
+
+/* items are kept in parallel arrays indexed by item number */
+static char *blob;                         // text of all items, not NUL-ended
+static size_t bloblen, blobsz, blobpos;    // fill, size, start of partial line
+static uint64_t *itemoff;                  // offset of each text in blob
+static uint32_t *itemlen;                  // its length
+static uint64_t *itemmask;                 // its character classes, see strmask()
+static unsigned int *itemwidth;            // its rendered width, 0 until measured
+static double *itemdist;                   // its distance in the last fuzzy scan
+static int32_t *itemboost;                 // its history boost, -1 until looked up
+static uint64_t *itemout;                  // bitset of items printed already
+static size_t nitems, itemsz;
+
+static size_t *matchv, nmatches, matchsz;  // matching items in display order
+static size_t prev, curr, next, sel;       // positions in matchv
+static size_t matcheditems;                // items the last match covers, 0 for none
+static char matchedtext[sizeof text];      // its query
+static struct slice matchcls;              // match() results so far, by class
+static size_t npicked;                     // remembered picks listed first, for ""
+
+/* what the last drawmenu() showed, so only the damaged parts get repainted */
+static struct {
+	int valid;
+	char text[sizeof text];
+	size_t cursor;
+	int focused, nomatches, larrow, rarrow, inputx;
+	size_t *item;           /* visible items */
+	int *scm;               /* their color schemes */
+	int *x;                 /* their positions in a horizontal menu */
+	int n, sz;
+} frame;
+
+static struct slice *slices;               // per thread scan results
+static size_t *scancand, scanncand, scanbase; // what fuzzyscan() walks, and
+                                           // tokenscan() from scanbase on
+static uint64_t querymask;                 // classes every match must contain
+static uint_fast8_t scanalign;             // alignscan() scores the best alignment
+static char querylo[sizeof text];          // query bytes in either case
+static char queryup[sizeof text];
+
+static Needle *tokv;                       // tokens of the -F query, rarest first
+static Needle *tokfirst;                   // the token typed first
+static int tokc;
+static size_t textlen;
+static size_t bytefreq[256], freqitems;    // byte counts in a sample of items
+static unsigned char bytecls[256];         // class of each byte, see bonus()
+
+static size_t rankn, ranked;               // fuzzy matches, sorted up to ranked
+
+static struct fuzzylevel *levels;          // stack of narrowing fuzzy results
+static size_t nlevels, levelsz;
+static char leveltext[sizeof text];        // query of the topmost level
 
 static const char worddelimiters[] = " ";
 
@@ -100,6 +239,10 @@ static uint_fast8_t fast = 0;              // grab keyboard before stdin
 static uint_fast8_t override_redirect = 1; // set the override redirect flag
 static uint_fast8_t resized = 0;           // dmenu window was already resized
 static uint_fast8_t focused = 0;           // dmenu window has focus
+static uint_fast8_t streaming = 0;         // stdin is read while the menu runs
+static uint_fast8_t pendingmatch = 0;      // input changed since the last match
+static uint_fast8_t pendingdraw = 0;       // menu changed since the last frame
+static uint_fast8_t icase = 0;             // match case insensitively
 
 static uint_fast16_t lines;                // lines for a vertical listing
 static uint_fast16_t linehusr;             // user specified minimum line height
@@ -128,21 +271,127 @@ static int currevert;
 static Drw *drw;
 static Clr *scheme[SchemeLast];
 
-static int (*fstrncmp)(const char *, const char *, size_t) = strncmp;
-static char *(*fstrstr)(const char *, const char *) = strstr;
+static int (*fmemcmp)(const void *, const void *, size_t) = memcmp;
 static void (*fmatch)(void) = fuzzymatch;
 
 static void
-appenditem(struct item *item, struct item **list, struct item **last)
+additem(size_t off, size_t len)
 {
-	if (*last)
-		(*last)->right = item;
-	else
-		*list = item;
+	size_t words = nitems ? itemsz / 64 + 1 : 0;
+
+	if (nitems == itemsz) {
+		itemsz = itemsz ? itemsz * 2 : BUFSIZ;
+		if (!(itemoff = realloc(itemoff, itemsz * sizeof *itemoff)) ||
+		    !(itemlen = realloc(itemlen, itemsz * sizeof *itemlen)) ||
+		    !(itemmask = realloc(itemmask, itemsz * sizeof *itemmask)) ||
+		    !(itemwidth = realloc(itemwidth, itemsz * sizeof *itemwidth)) ||
+		    !(itemdist = realloc(itemdist, itemsz * sizeof *itemdist)) ||
+		    !(itemboost = realloc(itemboost, itemsz * sizeof *itemboost)) ||
+		    !(itemout = realloc(itemout, (itemsz / 64 + 1) * sizeof *itemout)))
+			die("cannot realloc %u bytes:", itemsz * sizeof *itemoff);
+		memset(itemout + words, 0, (itemsz / 64 + 1 - words) * sizeof *itemout);
+	}
+	itemoff[nitems] = off;
+	itemlen[nitems] = len;
+	itemmask[nitems] = strmask(blob + off, len);
+	itemwidth[nitems] = 0;
+	itemboost[nitems] = -1;
+	nitems++;
+}
+
+static void
+growmatches(size_t n)
+{
+	if (n <= matchsz)
+		return;
+	matchsz = MAX(n, matchsz * 2);
+	if (!(matchv = realloc(matchv, matchsz * sizeof *matchv)))
+		die("cannot realloc %u bytes:", matchsz * sizeof *matchv);
+}
+
+/* How often and how lately the text of slot e was picked. */
+static int32_t
+frecency(const struct histslot *e)
+{
+	uint32_t age = histnow - e->last;
+	uint32_t w = age < 4 ? 16 : age < 24 ? 8 : age < 24 * 7 ? 4 : 1;
+
+	return MIN((uint64_t)e->count * w, BOOSTMAX);
+}
+
+/* Return the history boost of item i, looking it up the first time. */
+static int32_t
+boost(size_t i)
+{
+	uint64_t h;
+	size_t k;
+
+	if (!hist)
+		return 0;
+	if (itemboost[i] < 0) {
+		h = hashtext(ITEXT(i), itemlen[i]);
+		itemboost[i] = 0;
+		/* picks are stored in the first free slot after their hash */
+		for (k = 0; k < HISTPROBE && hist[(h + k) % HISTSLOTS].hash; k++)
+			if (hist[(h + k) % HISTSLOTS].hash == h) {
+				itemboost[i] = frecency(&hist[(h + k) % HISTSLOTS]);
+				break;
+			}
+	}
+	return itemboost[i];
+}
+
+static int
+compare_boost(const void *a, const void *b)
+{
+	size_t ia = *(size_t *) a;
+	size_t ib = *(size_t *) b;
 
-	item->left = *last;
-	item->right = NULL;
-	*last = item;
+	if (itemboost[ia] == itemboost[ib]) /* keep input order among equals */
+		return ia == ib ? 0 : ia < ib ? -1 : 1;
+	return itemboost[ia] > itemboost[ib] ? -1 : 1;
+}
+
+/* Remember that s was picked, taking the slot of its hash or else the
+ * least used one it may be stored in. */
+static void
+histpick(const char *s)
+{
+	uint64_t h = hashtext(s, strlen(s));
+	struct histslot *e, *slot = NULL;
+	size_t k;
+
+	if (!hist)
+		return;
+	for (k = 0; k < HISTPROBE; k++) {
+		e = &hist[(h + k) % HISTSLOTS];
+		if (e->hash == h || !e->hash) {
+			slot = e;
+			break;
+		}
+		if (!slot || frecency(e) < frecency(slot))
+			slot = e;
+	}
+	if (slot->hash != h) {
+		slot->hash = h;
+		slot->count = 0;
+	}
+	slot->count = MIN(slot->count + 1, UINT32_MAX / 16);
+	slot->last = histnow;
+}
+
+/* Look the boost of every item sharing the hash of s up again. */
+static void
+histforget(const char *s)
+{
+	uint64_t h = hashtext(s, strlen(s));
+	size_t i;
+
+	if (!hist)
+		return;
+	for (i = 0; i < nitems; i++)
+		if (itemboost[i] >= 0 && hashtext(ITEXT(i), itemlen[i]) == h)
+			itemboost[i] = -1;
 }
 
 static void
@@ -153,16 +402,74 @@ calcoffsets(void)
 	if (lines > 0)
 		n = lines * lineh;
 	else
-		n = menuw - (promptw + inputw + TEXTW("<") + TEXTW(">"));
-	/* calculate which items will begin the next page and previous page */
-	for (i = 0, next = curr; next; next = next->right)
-		if ((i += (lines > 0) ? lineh : MIN(TEXTW(next->text), n)) > n)
+		n = menuw - (promptw + inputw + arroww("<") + arroww(">"));
+	/* calculate which items will begin the next page and previous page,
+	 * ranking more matches before an unsorted one would be shown */
+	for (i = 0, next = curr; next < nmatches; next++) {
+		if (next == ranked && ranked < rankn) {
+			rankmore(RANKMIN);
+			calcoffsets();
+			return;
+		}
+		if ((i += (lines > 0) ? lineh : MIN(itemw(matchv[next]), n)) > n)
 			break;
-	for (i = 0, prev = curr; prev && prev->left; prev = prev->left)
-		if ((i += (lines > 0) ? lineh : MIN(TEXTW(prev->left->text), n)) > n)
+	}
+	for (i = 0, prev = curr; prev > 0; prev--)
+		if ((i += (lines > 0) ? lineh : MIN(itemw(matchv[prev - 1]), n)) > n)
 			break;
 }
 
+static void
+flushwidths(void)
+{
+	/* widths measured with another fontset are stale */
+	if (nitems)
+		memset(itemwidth, 0, nitems * sizeof *itemwidth);
+	larroww = rarroww = 0;
+	widthgen = drw->fontgen;
+}
+
+/* Return the text of item i ended by a NUL, in a buffer reused by the
+ * next call. A mapped stdin keeps its newlines, so items only have a
+ * length. */
+static const char *
+itemstr(size_t i)
+{
+	static char *buf;
+	static size_t bufsz;
+
+	if (itemlen[i] >= bufsz) {
+		bufsz = itemlen[i] + 1;
+		if (!(buf = realloc(buf, bufsz)))
+			die("cannot realloc %u bytes:", bufsz);
+	}
+	memcpy(buf, ITEXT(i), itemlen[i]);
+	buf[itemlen[i]] = '\0';
+	return buf;
+}
+
+static unsigned int
+itemw(size_t i)
+{
+	if (widthgen != drw->fontgen)
+		flushwidths();
+	if (!itemwidth[i])
+		itemwidth[i] = TEXTW(itemstr(i));
+	return itemwidth[i];
+}
+
+static unsigned int
+arroww(const char *arrow)
+{
+	unsigned int *w = *arrow == '<' ? &larroww : &rarroww;
+
+	if (widthgen != drw->fontgen)
+		flushwidths();
+	if (!*w)
+		*w = TEXTW(arrow);
+	return *w;
+}
+
 static void
 cleanup(void)
 {
@@ -181,35 +488,45 @@ cleanup(void)
 	XCloseDisplay(dpy);
 }
 
+/* Exit with status, telling the client of a -D menu. */
+static void
+leave(int status)
+{
+	unsigned char c = status;
+
+	cleanup();
+	if (clientfd >= 0) {
+		fflush(stdout);
+		write(clientfd, &c, 1);
+	}
+	exit(status);
+}
+
 static int
-drawitem(struct item *item, int x, int y, int w)
+itemscheme(size_t pos)
 {
-	if (item == sel)
-		drw_setscheme(drw, scheme[SchemeSel]);
-	else if (item->out)
-		drw_setscheme(drw, scheme[SchemeOut]);
-	else
-		drw_setscheme(drw, scheme[SchemeNorm]);
+	if (pos == sel)
+		return SchemeSel;
+	else if (ISOUT(matchv[pos]))
+		return SchemeOut;
+	return SchemeNorm;
+}
 
-	return drw_text(drw, x, y, w, lineh, lrpad / 2, item->text, 0);
+static int
+drawitem(size_t pos, int x, int y, int w)
+{
+	drw_setscheme(drw, scheme[itemscheme(pos)]);
+
+	return drw_text(drw, x, y, w, lineh, lrpad / 2, itemstr(matchv[pos]), 0);
 }
 
 static void
-drawmenu(void)
+drawinput(int x)
 {
 	static char _curbuf[BUFSIZ];
-	struct item *item;
-	int x = 0, y = 0, fh = drw->fonts->h, w, cx, cw;
+	int fh = drw->fonts->h, w, cx, cw;
 	long _utfcp;
 
-	drw_setscheme(drw, scheme[SchemeNorm]);
-	drw_rect(drw, 0, 0, menuw, menuh, 1, 1);
-
-	if (prompt && *prompt) {
-		drw_setscheme(drw, scheme[SchemeSel]);
-		x = drw_text(drw, x, 0, promptw, lineh, lrpad / 2, prompt, 0);
-	}
-
 	/* prepare the cursor */
 	memset(_curbuf, 0, BUFSIZ);
 	if (text[cursor] == '\0')
@@ -223,7 +540,7 @@ drawmenu(void)
 	cx = drw_fontset_getwidth(drw, _curbuf);
 
 	/* draw input field */
-	w = (lines > 0 || !matches) ? menuw - x : inputw;
+	w = (lines > 0 || !nmatches) ? menuw - x : inputw;
 	drw_setscheme(drw, scheme[SchemeNorm]);
 	drw_text(drw, x, 0, w, lineh, lrpad / 2, text, 0);
 
@@ -231,29 +548,117 @@ drawmenu(void)
 	drw_setscheme(drw, scheme[SchemeCur]);
 	drw_rect(drw, x + cx + lrpad / 2, (lineh - fh)/2, cw, fh,
 			text[cursor] == '\0' && focused, 0);
+}
+
+static void
+drawmenu(void)
+{
+	size_t p;
+	int x = 0, y = 0, w, i, n = next - curr, full = !frame.valid, list = full;
+
+	/* compare what this frame shows with the last one */
+	if (n > frame.sz) {
+		frame.sz = MAX(n, 64);
+		if (!(frame.item = realloc(frame.item, frame.sz * sizeof *frame.item)) ||
+		    !(frame.scm = realloc(frame.scm, frame.sz * sizeof *frame.scm)) ||
+		    !(frame.x = realloc(frame.x, frame.sz * sizeof *frame.x)))
+			die("cannot realloc %u bytes:", frame.sz * sizeof *frame.item);
+	}
+	for (i = 0; i < n && !list; i++)
+		if (i >= frame.n || frame.item[i] != matchv[curr + i])
+			list = 1;
+	if ((nmatches == 0) != frame.nomatches)
+		full = 1;
+	if (lines == 0 && (n != frame.n || (curr > 0) != frame.larrow ||
+	    (next < nmatches) != frame.rarrow))
+		list = 1;
+
+	if (full) {
+		drw_setscheme(drw, scheme[SchemeNorm]);
+		drw_rect(drw, 0, 0, menuw, menuh, 1, 1);
+
+		if (prompt && *prompt) {
+			drw_setscheme(drw, scheme[SchemeSel]);
+			x = drw_text(drw, x, 0, promptw, lineh, lrpad / 2, prompt, 0);
+		}
+		frame.inputx = x;
+	}
+	x = frame.inputx;
+
+	if (full || strcmp(text, frame.text) || cursor != frame.cursor ||
+	    focused != frame.focused) {
+		drawinput(x);
+		if (!full)
+			drw_map(drw, dmenuW, x, 0, (lines > 0 || !nmatches) ? menuw - x : inputw, lineh);
+	}
 
 	if (lines > 0) {
-		/* draw vertical list */
-		for (item = curr; item != next; item = item->right)
-			drawitem(item, x, y += lineh, menuw - x);
-	} else if (matches) {
+		/* draw vertical list, repainting only the rows that changed */
+		for (i = 0, p = curr; i < MAX(n, frame.n); i++, p++) {
+			y = (i + 1) * lineh;
+			if (i < n && (full || i >= frame.n || frame.item[i] != matchv[p] ||
+			    frame.scm[i] != itemscheme(p)))
+				drawitem(p, x, y, menuw - x);
+			else if (i >= n && !full) {
+				drw_setscheme(drw, scheme[SchemeNorm]);
+				drw_rect(drw, 0, y, menuw, lineh, 1, 1);
+			} else
+				continue;
+			if (!full)
+				drw_map(drw, dmenuW, 0, y, menuw, lineh);
+		}
+	} else if (nmatches && list) {
 		/* draw horizontal list */
 		x += inputw;
-		w = TEXTW("<");
-		if (curr->left) {
+		if (!full) {
+			drw_setscheme(drw, scheme[SchemeNorm]);
+			drw_rect(drw, x, 0, menuw - x, lineh, 1, 1);
+		}
+		w = arroww("<");
+		if (curr > 0) {
 			drw_setscheme(drw, scheme[SchemeNorm]);
 			drw_text(drw, x, 0, w, lineh, lrpad / 2, "<", 0);
 		}
 		x += w;
-		for (item = curr; item != next; item = item->right)
-			x = drawitem(item, x, 0, MIN(TEXTW(item->text), menuw - x - TEXTW(">")));
-		if (next) {
-			w = TEXTW(">");
+		for (i = 0, p = curr; p < next; p++, i++) {
+			frame.x[i] = x;
+			x = drawitem(p, x, 0, MIN(itemw(matchv[p]), menuw - x - arroww(">")));
+		}
+		if (next < nmatches) {
+			w = arroww(">");
 			drw_setscheme(drw, scheme[SchemeNorm]);
 			drw_text(drw, menuw - w, 0, w, lineh, lrpad / 2, ">", 0);
 		}
+		if (!full)
+			drw_map(drw, dmenuW, frame.inputx + inputw, 0,
+			        menuw - frame.inputx - inputw, lineh);
+	} else if (nmatches) {
+		/* same page, repaint the items whose scheme changed */
+		for (i = 0, p = curr; p < next; p++, i++) {
+			if (frame.scm[i] == itemscheme(p))
+				continue;
+			w = MIN(itemw(matchv[p]), menuw - frame.x[i] - arroww(">"));
+			drawitem(p, frame.x[i], 0, w);
+			drw_map(drw, dmenuW, frame.x[i], 0, w, lineh);
+		}
+	}
+	if (full)
+		drw_map(drw, dmenuW, 0, 0, menuw, menuh);
+
+	/* remember this frame */
+	for (i = 0, p = curr; p < next; p++, i++) {
+		frame.item[i] = matchv[p];
+		frame.scm[i] = itemscheme(p);
 	}
-	drw_map(drw, dmenuW, 0, 0, menuw, menuh);
+	frame.n = n;
+	frame.larrow = curr > 0;
+	frame.rarrow = next < nmatches;
+	frame.nomatches = !nmatches;
+	frame.focused = focused;
+	frame.cursor = cursor;
+	strcpy(frame.text, text);
+	frame.valid = 1;
+	drw_flush(drw);
 }
 
 static void
@@ -294,135 +699,592 @@ grabkeyboard(void)
 static int
 compare_distance(const void *a, const void *b)
 {
-	struct item *da = *(struct item **) a;
-	struct item *db = *(struct item **) b;
+	size_t ia = *(size_t *) a;
+	size_t ib = *(size_t *) b;
+	double da = itemdist[ia];
+	double db = itemdist[ib];
+
+	if (da == db) /* keep input order among equals */
+		return ia == ib ? 0 : ia < ib ? -1 : 1;
+	return da < db ? -1 : 1;
+}
 
-	if (!db)
-		return 1;
-	if (!da)
-		return -1;
+static void
+sliceput(struct slice *sl, int cls, size_t idx)
+{
+	if (sl->nout[cls] == sl->sz[cls]) {
+		sl->sz[cls] = sl->sz[cls] ? sl->sz[cls] * 2 : 1024;
+		if (!(sl->out[cls] = realloc(sl->out[cls], sl->sz[cls] * sizeof *sl->out[cls])))
+			die("cannot realloc %u bytes:", sl->sz[cls] * sizeof *sl->out[cls]);
+	}
+	sl->out[cls][sl->nout[cls]++] = idx;
+}
 
-	return da->distance == db->distance ? 0 : da->distance < db->distance ? -1 : 1;
+/* Partition v so that v[k] holds what sorting would put there, with
+ * only smaller elements before it. */
+static void
+selectk(size_t *v, size_t n, size_t k)
+{
+	long lo = 0, hi = n - 1, i, j;
+	size_t pivot, t;
+
+	while (lo < hi) {
+		pivot = v[lo + (hi - lo) / 2];
+		for (i = lo, j = hi; i <= j; ) {
+			while (compare_distance(&v[i], &pivot) < 0)
+				i++;
+			while (compare_distance(&v[j], &pivot) > 0)
+				j--;
+			if (i <= j) {
+				t = v[i];
+				v[i++] = v[j];
+				v[j--] = t;
+			}
+		}
+		if ((long)k <= j)
+			hi = j;
+		else if ((long)k >= i)
+			lo = i;
+		else
+			break;
+	}
 }
 
+/* Sort at least k more fuzzy matches, the rest stays in scan order. */
 static void
-fuzzymatch(void)
+rankmore(size_t k)
+{
+	size_t upto = MIN(rankn, ranked + MAX(k, ranked));
+
+	if (upto < rankn)
+		selectk(matchv + ranked, rankn - ranked, upto - ranked);
+	if (upto > ranked)
+		qsort(matchv + ranked, upto - ranked, sizeof *matchv, compare_distance);
+	ranked = upto;
+}
+
+/* Sort the bytes into the classes bonus() looks up. Run once before any
+ * scan, which reads the table from every thread. */
+static void
+classifybytes(void)
 {
-	/* bang - we have so much memory */
-	struct item *it;
-	struct item **fuzzymatches = NULL;
-	char c;
-	int number_of_matches = 0, i, pidx, sidx, eidx;
-	int text_len = strlen(text), itext_len;
-
-	matches = matchend = NULL;
-
-	/* walk through all items */
-	for (it = items; it && it->text; it++) {
-		if (text_len) {
-			itext_len = strlen(it->text);
-			pidx = 0; /* pointer */
-			sidx = eidx = -1; /* start of match, end of match */
-			/* walk through item text */
-			for (i = 0; i < itext_len && (c = it->text[i]); i++) {
-				/* fuzzy match pattern */
-				if (!fstrncmp(&text[pidx], &c, 1)) {
-					if(sidx == -1)
-						sidx = i;
-					pidx++;
-					if (pidx == text_len) {
-						eidx = i;
-						break;
-					}
-				}
+	int c;
+
+	for (c = 0; c < 256; c++)
+		bytecls[c] = (c == ' ' || c == '\t') ? ByteWhite : c == '/' ? ByteSlash :
+		             islower(c) ? ByteLower : isupper(c) ? ByteUpper :
+		             isdigit(c) ? ByteDigit : c < 0x80 ? BytePunct : ByteOther;
+}
+
+/* Bonus for a query byte matched at s[i], higher where a word starts. */
+static int
+bonus(const char *s, int i)
+{
+	static const unsigned char tab[ByteLast][ByteLast] = {
+		/* previous byte by row, this byte by column */
+		[ByteWhite] = { BONUSWHITE, BONUSWHITE, BONUSWHITE, BONUSWHITE, BONUSWHITE, BONUSWHITE, BONUSWHITE },
+		[ByteSlash] = { BONUSSLASH, BONUSSLASH, BONUSSLASH, BONUSSLASH, BONUSSLASH, BONUSSLASH, BONUSSLASH },
+		[BytePunct] = { BONUSBOUNDARY, BONUSBOUNDARY, BONUSBOUNDARY, BONUSBOUNDARY, BONUSBOUNDARY, BONUSBOUNDARY, BONUSBOUNDARY },
+		[ByteLower] = { [ByteUpper] = BONUSCAMEL, [ByteDigit] = BONUSCAMEL },
+		[ByteUpper] = { [ByteDigit] = BONUSCAMEL },
+		[ByteOther] = { [ByteDigit] = BONUSCAMEL },
+	};
+
+	return tab[i ? bytecls[(unsigned char)s[i - 1]] : ByteWhite][bytecls[(unsigned char)s[i]]];
+}
+
+/* Score the alignment of the m query bytes in s at the first places
+ * they can be, the leftmost one. */
+static int32_t
+firstscore(const char *s, const int32_t *first, int m)
+{
+	int32_t j, b, run = 0, sc = 0;
+
+	for (j = 0; j < m; j++) {
+		b = bonus(s, first[j]);
+		if (!j)
+			run = 2 * b;
+		else if (first[j] == first[j - 1] + 1)
+			run = MAX(MAX(run, b), BONUSCONSEC);
+		else {
+			sc += SCOREGAPSTART + (first[j] - first[j - 1] - 2) * SCOREGAPEXT;
+			run = b;
+		}
+		sc += SCOREMATCH + run;
+	}
+	return sc;
+}
+
+/* Score the best alignment of the m query bytes in s, where query byte j
+ * can only sit between first[j] and last[j]. A row of the table holds
+ * just the places of one query byte in that band, and alignments too
+ * large for FUZZYCELLS are scored along the first places instead. */
+static int32_t
+fuzzyscore(struct slice *sl, const char *s, const int32_t *first,
+           const int32_t *last, int m)
+{
+	int32_t *ppos, *psc, *pb, *cpos, *csc, *cb, *t;
+	int32_t w = last[m - 1] - first[0] + 1, np, nc, i, j, k, g, b, run, sc;
+	const char *p, *end;
+
+	if ((size_t)w * m > FUZZYCELLS)
+		return firstscore(s, first, m);
+
+	if (2 * m + 6 * (size_t)w > sl->dpsz) {
+		sl->dpsz = 2 * m + 6 * (size_t)w;
+		if (!(sl->dp = realloc(sl->dp, sl->dpsz * sizeof *sl->dp)))
+			die("cannot realloc %u bytes:", sl->dpsz * sizeof *sl->dp);
+		first = sl->dp;
+		last = sl->dp + m;
+	}
+	ppos = sl->dp + 2 * m;
+	psc = ppos + w;
+	pb = psc + w;
+	cpos = pb + w;
+	csc = cpos + w;
+	cb = csc + w;
+
+	/* the first byte has no predecessor, its bonus counts twice */
+	end = s + last[0] + 1;
+	for (nc = 0, p = s + first[0]; p; p = findbyte(p + 1, end, querylo[0], queryup[0])) {
+		cpos[nc] = p - s;
+		cb[nc] = 2 * bonus(s, p - s);
+		csc[nc] = SCOREMATCH + cb[nc];
+		nc++;
+	}
+	for (j = 1; j < m; j++) {
+		t = ppos, ppos = cpos, cpos = t;
+		t = psc, psc = csc, csc = t;
+		t = pb, pb = cb, cb = t;
+		np = nc;
+		end = s + last[j] + 1;
+		/* g is the best gapped score of byte j-1, less the gap up to 0 */
+		p = findbyte(s + first[j], end, querylo[j], queryup[j]);
+		for (nc = 0, k = 0, g = SCORENONE; p; p = findbyte(p + 1, end, querylo[j], queryup[j])) {
+			i = p - s;
+			for (; k < np && ppos[k] <= i - 2; k++)
+				g = MAX(g, psc[k] - ppos[k] * SCOREGAPEXT);
+			b = bonus(s, i);
+			sc = g > SCORENONE ? g + SCOREGAPSTART + (i - 2) * SCOREGAPEXT + b : SCORENONE;
+			run = b;
+			if (k < np && ppos[k] == i - 1 &&
+			    psc[k] + MAX(MAX(pb[k], b), BONUSCONSEC) >= sc) {
+				run = MAX(MAX(pb[k], b), BONUSCONSEC);
+				sc = psc[k] + run;
 			}
-			/* build list of matches */
-			if (eidx != -1) {
-				/* compute distance */
-				/* add penalty if match starts late (log(sidx+2))
-				 * add penalty for long a match without many matching characters */
-				it->distance = log(sidx + 2) + (double)(eidx - sidx - text_len);
-				/* fprintf(stderr, "distance %s %f\n", it->text, it->distance); */
-				appenditem(it, &matches, &matchend);
-				number_of_matches++;
+			if (sc == SCORENONE)
+				continue;
+			cpos[nc] = i;
+			cb[nc] = run;
+			csc[nc++] = sc + SCOREMATCH;
+		}
+	}
+	for (k = 0, sc = SCORENONE; k < nc; k++)
+		sc = MAX(sc, csc[k]);
+	return sc;
+}
+
+/* Make room for the first and last places of the query bytes. */
+static void
+growdp(struct slice *sl, int m)
+{
+	if (2 * (size_t)m > sl->dpsz) {
+		sl->dpsz = 2 * m;
+		if (!(sl->dp = realloc(sl->dp, sl->dpsz * sizeof *sl->dp)))
+			die("cannot realloc %u bytes:", sl->dpsz * sizeof *sl->dp);
+	}
+}
+
+static void
+fuzzyscan(unsigned int slice, size_t lo, size_t hi)
+{
+	struct slice *sl = &slices[slice];
+	const char *s, *p, *end;
+	int32_t *first;
+	size_t n, it;
+	int pidx;
+	int text_len = strlen(text);
+
+	sl->nout[0] = 0;
+	growdp(sl, text_len);
+	/* walk through the candidates */
+	for (n = lo; n < hi; n++) {
+		it = n < scanncand ? scancand[n] : scanbase + n - scanncand;
+		/* most items lack some character class of the query */
+		if ((itemmask[it] & querymask) != querymask)
+			continue;
+		s = p = ITEXT(it);
+		end = s + itemlen[it];
+		first = sl->dp;
+		/* find each query byte after the previous one */
+		for (pidx = 0; pidx < text_len; pidx++, p++) {
+			if (!(p = findbyte(p, end, querylo[pidx], queryup[pidx])))
+				break;
+			first[pidx] = p - s;
+		}
+		if (pidx < text_len)
+			continue;
+		/* scored along the first places, alignscan() may do better once
+		 * the number of matches is known */
+		itemdist[it] = -firstscore(s, first, text_len) - boost(it);
+		sliceput(sl, 0, it);
+	}
+}
+
+/* Score the matches scancand[lo..hi) again, by their best alignment if
+ * scanalign is set and along the first places otherwise. */
+static void
+alignscan(unsigned int slice, size_t lo, size_t hi)
+{
+	struct slice *sl = &slices[slice];
+	const char *s, *p, *end;
+	int32_t *first, *last, sc;
+	size_t n, it;
+	int pidx;
+	int text_len = strlen(text);
+
+	growdp(sl, text_len);
+	for (n = lo; n < hi; n++) {
+		it = scancand[n];
+		s = p = ITEXT(it);
+		end = s + itemlen[it];
+		first = sl->dp;
+		for (pidx = 0; pidx < text_len; pidx++, p++)
+			first[pidx] = (p = findbyte(p, end, querylo[pidx], queryup[pidx])) - s;
+		if (scanalign) {
+			/* and the last place each can be, matching backwards */
+			last = sl->dp + text_len;
+			for (pidx = text_len - 1, p = end - 1; pidx >= 0; pidx--, p--) {
+				while (*p != querylo[pidx] && *p != queryup[pidx])
+					p--;
+				last[pidx] = p - s;
 			}
+			sc = fuzzyscore(sl, s, first, last, text_len);
 		} else {
-			appenditem(it, &matches, &matchend);
+			sc = firstscore(s, first, text_len);
 		}
+		itemdist[it] = -sc - boost(it);
 	}
+}
 
-	if (number_of_matches) {
-		/* initialize array with matches */
-		if (!(fuzzymatches = realloc(fuzzymatches, number_of_matches * sizeof(struct item*))))
-			die("cannot realloc %u bytes:", number_of_matches * sizeof(struct item*));
-		for (i = 0, it = matches; it && i < number_of_matches; i++, it = it->right) {
-			fuzzymatches[i] = it;
+/* Align the matches cand[lo..hi) of the current query if it has few
+ * enough matches in all, so that the scoring only depends on the query
+ * and the items, not on how the query was typed or the items read. */
+static void
+align(size_t *cand, size_t lo, size_t hi)
+{
+	if (!(scanalign = hi <= FUZZYALIGNMAX))
+		return;
+	scancand = cand + lo;
+	pool_run(hi - lo, ALIGNMIN, alignscan);
+}
+
+static void
+fuzzymatch(void)
+{
+	struct fuzzylevel *lvl;
+	size_t *fuzzymatches, n;
+	size_t number_of_matches = 0;
+	unsigned int i, nsl;
+	int text_len = strlen(text);
+
+	/* drop the levels whose query is no longer a prefix of the input */
+	while (nlevels && ((lvl = &levels[nlevels - 1])->textlen > text_len ||
+	       strncmp(leveltext, text, lvl->textlen)))
+		free(levels[--nlevels].cand);
+
+	/* the same query again only needs to place the items read since */
+	if (!matcheditems || strcmp(text, matchedtext)) {
+		nmatches = rankn = ranked = npicked = matcheditems = 0;
+		strcpy(matchedtext, text);
+	}
+
+	if (!text_len) {
+		/* remembered picks first, then the rest in input order */
+		for (n = matcheditems; n < nitems; n++)
+			if (boost(n))
+				number_of_matches++;
+		growmatches(nitems);
+		if (nmatches > npicked)
+			memmove(matchv + npicked + number_of_matches, matchv + npicked,
+			        (nmatches - npicked) * sizeof *matchv);
+		nmatches += number_of_matches;
+		for (n = matcheditems; n < nitems; n++) {
+			if (boost(n))
+				matchv[npicked++] = n;
+			else
+				matchv[nmatches++] = n;
+		}
+		if (npicked)
+			qsort(matchv, npicked, sizeof *matchv, compare_boost);
+		matcheditems = nitems;
+		goto done;
+	}
+
+	querymask = strmask(text, text_len);
+	for (n = 0; n < (size_t)text_len; n++) {
+		querylo[n] = icase ? FOLD((unsigned char)text[n]) : text[n];
+		queryup[n] = icase ? UNFOLD((unsigned char)text[n]) : text[n];
+	}
+	if (matcheditems) {
+		/* only the ranked matches can stay ahead of the new ones, which
+		 * are scored like the others of the level */
+		lvl = &levels[nlevels - 1];
+		scancand = NULL;
+		scanncand = 0;
+		scanbase = lvl->nitems;
+		nsl = pool_run(nitems - scanbase, PARMIN, fuzzyscan);
+		for (i = 0; i < nsl; i++)
+			number_of_matches += slices[i].nout[0];
+		if (!(lvl->cand = realloc(lvl->cand, MAX(lvl->n + number_of_matches, 1) * sizeof *lvl->cand)))
+			die("cannot realloc %u bytes:", (lvl->n + number_of_matches) * sizeof *lvl->cand);
+		for (i = 0, n = lvl->n; i < nsl; n += slices[i].nout[0], i++)
+			if (slices[i].nout[0])
+				memcpy(lvl->cand + n, slices[i].out[0], slices[i].nout[0] * sizeof *lvl->cand);
+		if (lvl->n <= FUZZYALIGNMAX && lvl->n + number_of_matches > FUZZYALIGNMAX) {
+			/* too many matches to align now, all are scored along the
+			 * first places and ranked again */
+			lvl->n += number_of_matches;
+			lvl->nitems = nitems;
+			scancand = lvl->cand;
+			scanalign = 0;
+			pool_run(lvl->n, PARMIN, alignscan);
+			goto rank;
 		}
-		/* sort matches according to distance */
-		qsort(fuzzymatches, number_of_matches, sizeof(struct item*), compare_distance);
-		/* rebuild list of matches */
-		matches = matchend = NULL;
-		for (i = 0, it = fuzzymatches[i];  i < number_of_matches && it && \
-				it->text; i++, it = fuzzymatches[i]) {
-			appenditem(it, &matches, &matchend);
+		align(lvl->cand, lvl->n, lvl->n + number_of_matches);
+
+		/* make room after the ranked matches, moving unranked ones to the end */
+		growmatches(nmatches + number_of_matches);
+		if (number_of_matches) {
+			memcpy(matchv + MAX(nmatches, ranked + number_of_matches), matchv + ranked,
+			       MIN(number_of_matches, nmatches - ranked) * sizeof *matchv);
+			memcpy(matchv + ranked, lvl->cand + lvl->n, number_of_matches * sizeof *matchv);
 		}
-		free(fuzzymatches);
+		nmatches = rankn = nmatches + number_of_matches;
+		n = MIN(ranked + number_of_matches, MAX(ranked, RANKMIN));
+		if (n < ranked + number_of_matches)
+			selectk(matchv, ranked + number_of_matches, n);
+		if (n)
+			qsort(matchv, n, sizeof *matchv, compare_distance);
+		ranked = n;
+		lvl->n += number_of_matches;
+		lvl->nitems = matcheditems = nitems;
+		goto done;
 	}
-	curr = sel = matches;
+
+	/* an extended query can only narrow the previous result set, items
+	 * read after that set was built are scanned in full */
+	scancand = NULL;
+	scanncand = scanbase = 0;
+	if (nlevels) {
+		scancand = levels[nlevels - 1].cand;
+		scanncand = levels[nlevels - 1].n;
+		scanbase = levels[nlevels - 1].nitems;
+	}
+	nsl = pool_run(scanncand + nitems - scanbase, PARMIN, fuzzyscan);
+
+	/* concatenate the slices, which keeps the serial scan order */
+	for (i = 0; i < nsl; i++)
+		number_of_matches += slices[i].nout[0];
+	if (!(fuzzymatches = malloc(MAX(number_of_matches, 1) * sizeof *fuzzymatches)))
+		die("cannot malloc %u bytes:", number_of_matches * sizeof *fuzzymatches);
+	for (i = 0, n = 0; i < nsl; n += slices[i].nout[0], i++)
+		if (slices[i].nout[0])
+			memcpy(fuzzymatches + n, slices[i].out[0], slices[i].nout[0] * sizeof *fuzzymatches);
+	/* aligning every match would cost a large list several times the
+	 * scan, it waits until the query has narrowed the matches */
+	align(fuzzymatches, 0, number_of_matches);
+
+	/* remember the result set, replacing the top level on a repeated query */
+	if (nlevels && levels[nlevels - 1].textlen == text_len)
+		free(levels[--nlevels].cand);
+	if (nlevels == levelsz && !(levels = realloc(levels, (levelsz += 16) * sizeof *levels)))
+		die("cannot realloc %u bytes:", levelsz * sizeof *levels);
+	lvl = &levels[nlevels++];
+	lvl->cand = fuzzymatches;
+	lvl->n = number_of_matches;
+	lvl->nitems = nitems;
+	lvl->textlen = text_len;
+	memcpy(leveltext, text, text_len + 1);
+
+rank:
+	/* sort the first pages of matches according to distance, the rest is
+	 * ranked once it is paged to */
+	growmatches(lvl->n);
+	if (lvl->n)
+		memcpy(matchv, lvl->cand, lvl->n * sizeof *matchv);
+	nmatches = rankn = lvl->n;
+	ranked = 0;
+	rankmore(RANKMIN);
+	matcheditems = nitems;
+
+done:
+	curr = sel = 0;
 	calcoffsets();
 }
 
 static void
-match(void)
+tokenscan(unsigned int slice, size_t lo, size_t hi)
 {
-	static char **tokv = NULL;
-	static int tokn = 0;
-
-	char buf[sizeof text], *s;
-	int i, tokc = 0;
-	size_t len, textsize;
-	struct item *item, *lprefix, *lsubstr, *prefixend, *substrend;
-
-	strcpy(buf, text);
-	/* separate input text into tokens to be matched individually */
-	for (s = strtok(buf, " "); s; tokv[tokc - 1] = s, s = strtok(NULL, " "))
-		if (++tokc > tokn && !(tokv = realloc(tokv, ++tokn * sizeof *tokv)))
-			die("cannot realloc %u bytes:", tokn * sizeof *tokv);
-	len = tokc ? strlen(tokv[0]) : 0;
+	struct slice *sl = &slices[slice];
+	const char *s, *end, *p, *first = NULL;
+	size_t n;
+	int i;
 
-	matches = lprefix = lsubstr = matchend = prefixend = substrend = NULL;
-	textsize = strlen(text) + 1;
-	for (item = items; item && item->text; item++) {
-		for (i = 0; i < tokc; i++)
-			if (!fstrstr(item->text, tokv[i]))
+	sl->nout[0] = sl->nout[1] = sl->nout[2] = sl->nout[3] = 0;
+	for (n = scanbase + lo; n < scanbase + hi; n++) {
+		if ((itemmask[n] & querymask) != querymask)
+			continue;
+		s = ITEXT(n);
+		end = s + itemlen[n];
+		/* the rarest token fails most items first */
+		for (i = 0; i < tokc; i++) {
+			if (!(p = findneedle(&tokv[i], s, end)))
 				break;
+			if (&tokv[i] == tokfirst)
+				first = p;
+		}
 		if (i != tokc) /* not all tokens match */
 			continue;
-		/* exact matches go first, then prefixes, then substrings */
-		if (!tokc || !fstrncmp(text, item->text, textsize))
-			appenditem(item, &matches, &matchend);
-		else if (!fstrncmp(tokv[0], item->text, len))
-			appenditem(item, &lprefix, &prefixend);
+		/* exact matches, remembered picks, prefixes, then substrings */
+		if (tokc && itemlen[n] == textlen && !fmemcmp(text, s, textlen))
+			sliceput(sl, 0, n);
+		else if (boost(n))
+			sliceput(sl, 3, n);
+		else if (!tokc || first == s)
+			sliceput(sl, 1, n);
 		else
-			appenditem(item, &lsubstr, &substrend);
-	}
-	if (lprefix) {
-		if (matches) {
-			matchend->right = lprefix;
-			lprefix->left = matchend;
-		} else
-			matches = lprefix;
-		matchend = prefixend;
-	}
-	if (lsubstr) {
-		if (matches) {
-			matchend->right = lsubstr;
-			lsubstr->left = matchend;
-		} else
-			matches = lsubstr;
-		matchend = substrend;
-	}
-	curr = sel = matches;
+			sliceput(sl, 2, n);
+	}
+}
+
+/* Count the bytes of a sample of the items, to tell rare ones. */
+static void
+countbytes(void)
+{
+	size_t n, k, step = MAX(nitems / FREQSAMPLE, 1);
+
+	memset(bytefreq, 0, sizeof bytefreq);
+	for (n = 0; n < nitems; n += step)
+		for (k = 0; k < itemlen[n]; k++)
+			bytefreq[(unsigned char)ITEXT(n)[k]]++;
+	freqitems = nitems;
+}
+
+/* How often byte c is seen in the items, in either case with -i. */
+static size_t
+freq(unsigned char c)
+{
+	if (icase && FOLD(c) != UNFOLD(c))
+		return bytefreq[FOLD(c)] + bytefreq[UNFOLD(c)];
+	return bytefreq[c];
+}
+
+/* Split the query into tokens, each searched for by its two rarest bytes,
+ * and order them so the one least likely to match is tried first. */
+static void
+compilequery(void)
+{
+	static int tokn = 0;
+	static double *cost;
+
+	const char *s, *e;
+	double c;
+	size_t i, j, k;
+	Needle t;
+	int n;
+
+	if (nitems > 2 * freqitems)
+		countbytes();
+	textlen = strlen(text);
+	querymask = 0;
+	for (tokc = 0, s = text; *s; s = e) {
+		if (*s == ' ') {
+			e = s + 1;
+			continue;
+		}
+		for (e = s; *e && *e != ' '; e++)
+			;
+		if (++tokc > tokn && (!(tokv = realloc(tokv, ++tokn * sizeof *tokv)) ||
+		    !(cost = realloc(cost, tokn * sizeof *cost))))
+			die("cannot realloc %u bytes:", tokn * sizeof *tokv);
+		for (i = 0, k = 1; k < (size_t)(e - s); k++)
+			if (freq(s[k]) < freq(s[i]))
+				i = k;
+		for (j = i ? 0 : (e - s > 1), k = j + 1; k < (size_t)(e - s); k++)
+			if (k != i && freq(s[k]) < freq(s[j]))
+				j = k;
+		mkneedle(&tokv[tokc - 1], s, e - s, i, j, icase);
+		/* the chance both bytes are where they are scanned for, longer
+		 * tokens first among equals */
+		cost[tokc - 1] = ((double)freq(s[i]) + 1) * ((double)freq(s[j]) + 1) / (e - s);
+		querymask |= strmask(s, e - s);
+	}
+
+	/* few tokens are typed, an insertion sort will do */
+	for (n = 1; n < tokc; n++) {
+		t = tokv[n];
+		c = cost[n];
+		for (k = n; k > 0 && cost[k - 1] > c; k--) {
+			tokv[k] = tokv[k - 1];
+			cost[k] = cost[k - 1];
+		}
+		tokv[k] = t;
+		cost[k] = c;
+	}
+	for (n = 0, tokfirst = tokv; n < tokc; n++)
+		if (tokv[n].s < tokfirst->s)
+			tokfirst = &tokv[n];
+}
+
+static void
+match(void)
+{
+	static const int order[] = { 0, 3, 1, 2 };
+
+	struct slice *mc = &matchcls;
+	unsigned int i, nsl;
+	size_t picked = 0;
+	int k, cls;
+
+	/* the same query only needs to match the items read since */
+	compilequery();
+	if (!matcheditems || strcmp(text, matchedtext)) {
+		mc->nout[0] = mc->nout[1] = mc->nout[2] = mc->nout[3] = 0;
+		matcheditems = 0;
+		strcpy(matchedtext, text);
+	}
+	scanbase = matcheditems;
+	nsl = pool_run(nitems - scanbase, PARMIN, tokenscan);
+	matcheditems = nitems;
+	for (cls = 0; cls < 4; cls++) {
+		for (i = 0; i < nsl; i++) {
+			if (mc->nout[cls] + slices[i].nout[cls] > mc->sz[cls]) {
+				mc->sz[cls] = MAX(mc->nout[cls] + slices[i].nout[cls], 2 * mc->sz[cls]);
+				if (!(mc->out[cls] = realloc(mc->out[cls], mc->sz[cls] * sizeof *mc->out[cls])))
+					die("cannot realloc %u bytes:", mc->sz[cls] * sizeof *mc->out[cls]);
+			}
+			if (slices[i].nout[cls])
+				memcpy(mc->out[cls] + mc->nout[cls], slices[i].out[cls],
+				       slices[i].nout[cls] * sizeof *mc->out[cls]);
+			mc->nout[cls] += slices[i].nout[cls];
+		}
+	}
+
+	/* put the classes one after another, each in input order but the
+	 * few remembered picks, which go by how much they were picked */
+	nmatches = rankn = ranked = 0;
+	growmatches(mc->nout[0] + mc->nout[1] + mc->nout[2] + mc->nout[3]);
+	for (k = 0; k < 4; k++) {
+		if ((cls = order[k]) == 3)
+			picked = nmatches;
+		if (mc->nout[cls])
+			memcpy(matchv + nmatches, mc->out[cls], mc->nout[cls] * sizeof *matchv);
+		nmatches += mc->nout[cls];
+		if (cls == 3 && nmatches > picked)
+			qsort(matchv + picked, nmatches - picked, sizeof *matchv, compare_boost);
+	}
+	curr = sel = 0;
 	calcoffsets();
 }
 
@@ -436,7 +1298,33 @@ insert(const char *str, ssize_t n)
 	if (n > 0)
 		memcpy(&text[cursor], str, n);
 	cursor += n;
-	fmatch();
+	pendingmatch = 1;
+}
+
+static void
+matchnow(void)
+{
+	if (pendingmatch) {
+		pendingmatch = 0;
+		fmatch();
+	}
+}
+
+/* Select item it again after a match, if it is among the ranked matches. */
+static void
+reselect(size_t it)
+{
+	size_t i;
+
+	for (i = 0; i < (rankn ? ranked : nmatches) && matchv[i] != it; i++)
+		;
+	if (i < (rankn ? ranked : nmatches)) {
+		sel = i;
+		while (sel >= next && next < nmatches) {
+			curr = next;
+			calcoffsets();
+		}
+	}
 }
 
 static size_t
@@ -471,6 +1359,7 @@ keypress(XKeyEvent *ev)
 {
 	char buf[32];
 	int len;
+	size_t it;
 	KeySym ksym;
 	Status status;
 
@@ -505,7 +1394,7 @@ keypress(XKeyEvent *ev)
 
 		case XK_k: /* delete right */
 			text[cursor] = '\0';
-			fmatch();
+			pendingmatch = 1;
 			break;
 		case XK_u: /* delete left */
 			insert(NULL, 0 - cursor);
@@ -531,8 +1420,7 @@ keypress(XKeyEvent *ev)
 		case XK_KP_Enter:
 			break;
 		case XK_bracketleft:
-			cleanup();
-			exit(1);
+			leave(1);
 		default:
 			return;
 		}
@@ -572,34 +1460,40 @@ insert:
 		insert(NULL, nextrune(-1) - cursor);
 		break;
 	case XK_End:
+		matchnow();
 		if (text[cursor] != '\0') {
 			cursor = strlen(text);
 			break;
 		}
-		if (next) {
+		if (ranked < rankn)
+			rankmore(rankn);
+		if (next < nmatches) {
 			/* jump to end of list and position items in reverse */
-			curr = matchend;
+			curr = nmatches - 1;
 			calcoffsets();
 			curr = prev;
 			calcoffsets();
-			while (next && (curr = curr->right))
+			while (next < nmatches) {
+				curr++;
 				calcoffsets();
+			}
 		}
-		sel = matchend;
+		sel = nmatches ? nmatches - 1 : 0;
 		break;
 	case XK_Escape:
-		cleanup();
-		exit(1);
+		leave(1);
 	case XK_Home:
-		if (sel == matches) {
+		matchnow();
+		if (sel == 0) {
 			cursor = 0;
 			break;
 		}
-		sel = curr = matches;
+		sel = curr = 0;
 		calcoffsets();
 		break;
 	case XK_Left:
-		if (cursor > 0 && (!sel || !sel->left || lines > 0)) {
+		matchnow();
+		if (cursor > 0 && (!nmatches || sel == 0 || lines > 0)) {
 			cursor = nextrune(-1);
 			break;
 		}
@@ -607,34 +1501,46 @@ insert:
 			return;
 		/* fallthrough */
 	case XK_Up:
-		if (sel && sel->left && (sel = sel->left)->right == curr) {
+		matchnow();
+		if (nmatches && sel > 0 && sel-- == curr) {
 			curr = prev;
 			calcoffsets();
 		}
 		break;
 	case XK_Next:
-		if (!next)
+		matchnow();
+		if (next >= nmatches)
 			return;
 		sel = curr = next;
 		calcoffsets();
 		break;
 	case XK_Prior:
-		if (!prev)
+		matchnow();
+		if (!nmatches)
 			return;
 		sel = curr = prev;
 		calcoffsets();
 		break;
 	case XK_Return:
 	case XK_KP_Enter:
-		puts((sel && !(ev->state & ShiftMask)) ? sel->text : text);
-		if (!(ev->state & ControlMask)) {
-			cleanup();
-			exit(0);
+		matchnow();
+		puts((nmatches && !(ev->state & ShiftMask)) ? itemstr(matchv[sel]) : text);
+		histpick((nmatches && !(ev->state & ShiftMask)) ? itemstr(matchv[sel]) : text);
+		if (!(ev->state & ControlMask))
+			leave(0);
+		if (nmatches)
+			itemout[matchv[sel] / 64] |= 1ULL << (matchv[sel] % 64);
+		if (hist) {
+			/* its boost may move it, the selection stays on it */
+			histforget((nmatches && !(ev->state & ShiftMask)) ? itemstr(matchv[sel]) : text);
+			it = nmatches ? matchv[sel] : (size_t)-1;
+			matcheditems = 0;
+			fmatch();
+			reselect(it);
 		}
-		if (sel)
-			sel->out = 1;
 		break;
 	case XK_Right:
+		matchnow();
 		if (text[cursor] != '\0') {
 			cursor = nextrune(+1);
 			break;
@@ -643,23 +1549,25 @@ insert:
 			return;
 		/* fallthrough */
 	case XK_Down:
-		if (sel && sel->right && (sel = sel->right) == next) {
+		matchnow();
+		if (nmatches && sel + 1 < nmatches && ++sel == next) {
 			curr = next;
 			calcoffsets();
 		}
 		break;
 	case XK_Tab:
-		if (!sel)
+		matchnow();
+		if (!nmatches)
 			return;
-		strncpy(text, sel->text, sizeof text - 1);
+		strncpy(text, itemstr(matchv[sel]), sizeof text - 1);
 		text[sizeof text - 1] = '\0';
 		cursor = strlen(text);
-		fmatch();
+		pendingmatch = 1;
 		break;
 	}
 
 draw:
-	drawmenu();
+	pendingdraw = 1;
 }
 
 static void
@@ -677,58 +1585,266 @@ paste(void)
 		insert(p, (q = strchr(p, '\n')) ? q - p : (ssize_t)strlen(p));
 		XFree(p);
 	}
-	drawmenu();
+	pendingdraw = 1;
 }
 
+static ssize_t
+ingest(int fd)
+{
+	char *s, *p;
+	ssize_t n;
+
+	/* lines are split in place in one growing blob */
+	if (blobsz - bloblen < 2) {
+		blobsz = MAX(ARENASIZ, blobsz * 2);
+		if (!(blob = realloc(blob, blobsz)))
+			die("cannot realloc %u bytes:", blobsz);
+	}
+	if ((n = read(fd, blob + bloblen, blobsz - 1 - bloblen)) < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return -1;
+		die("read:");
+	}
+	if (!n && blobpos < bloblen) {
+		/* last line without a newline */
+		blob[bloblen++] = '\0';
+		additem(blobpos, bloblen - 1 - blobpos);
+		blobpos = bloblen;
+	}
+	for (s = blob + bloblen, bloblen += n;
+	     (p = memchr(s, '\n', blob + bloblen - s)); s = p + 1) {
+		*p = '\0';
+		additem(blobpos, p - blob - blobpos);
+		blobpos = p + 1 - blob;
+	}
+	return n;
+}
+
+static int
+mapstdin(void)
+{
+	struct stat st;
+	off_t off, base;
+	char *s, *p, *end;
+
+	if (fstat(STDIN_FILENO, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    (off = lseek(STDIN_FILENO, 0, SEEK_CUR)) < 0 || off >= st.st_size)
+		return 0;
+	base = off - off % sysconf(_SC_PAGESIZE);
+	if ((blob = mmap(NULL, st.st_size - base, PROT_READ, MAP_SHARED,
+	                 STDIN_FILENO, base)) == MAP_FAILED) {
+		blob = NULL;
+		return 0;
+	}
+
+	/* the mapping is only read, items are told apart by their lengths */
+	end = blob + (st.st_size - base);
+	for (s = blob + (off - base); (p = memchr(s, '\n', end - s)); s = p + 1)
+		additem(s - blob, p - s);
+	if (s < end) /* last line without a newline */
+		additem(s - blob, end - s);
+	/* stdin is left consumed, as reading it would have */
+	lseek(STDIN_FILENO, 0, SEEK_END);
+	return 1;
+}
+
+/* Whether the n items of size each at off lie within a file of size bytes. */
+#define CATFITS(OFF, N, SIZE, FSIZE) \
+	((OFF) % 8 == 0 && (OFF) <= (FSIZE) && (N) <= ((FSIZE) - (OFF)) / (SIZE))
+
 static void
-readstdin(void)
+openhist(void)
 {
-	char buf[sizeof text], *p;
-	size_t i, imax = 0, size = 0;
-	unsigned int tmpmax = 0;
+	struct histhdr *h;
+	struct stat st;
+	size_t size = sizeof *h + HISTSLOTS * sizeof *hist;
+	char *map;
+	int fd;
+
+	/* a missing or foreign history only costs the boosts */
+	if ((fd = open(histfile, O_RDWR | O_CREAT, 0600)) < 0 || fstat(fd, &st) < 0 ||
+	    (!st.st_size && ftruncate(fd, size) < 0) ||
+	    (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "warning: cannot map %s: %s\n", histfile, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	close(fd);
+	h = (struct histhdr *)map;
+	if (!st.st_size) {
+		memcpy(h->magic, "dmenuhst", sizeof h->magic);
+		h->version = HISTVERSION;
+		h->nslots = HISTSLOTS;
+	} else if ((size_t)st.st_size != size || memcmp(h->magic, "dmenuhst", sizeof h->magic) ||
+	           h->version != HISTVERSION || h->nslots != HISTSLOTS) {
+		fprintf(stderr, "warning: %s is not a history of version %d\n", histfile, HISTVERSION);
+		munmap(map, size);
+		return;
+	}
+	hist = (struct histslot *)(map + sizeof *h);
+	histnow = time(NULL) / 3600;
+}
+
+static void
+readcatalog(void)
+{
+	struct stat st;
+	const CatHdr *h;
+	char *map;
+	size_t i;
+	int fd;
+
+	if ((fd = open(catalog, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+		die("open %s:", catalog);
+	if ((size_t)st.st_size < sizeof *h)
+		die("%s: not a catalog", catalog);
+	if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		die("mmap %s:", catalog);
+	close(fd);
+
+	/* the tables are used in place, once they are known to fit */
+	h = (const CatHdr *)map;
+	if (memcmp(h->magic, CATMAGIC, sizeof h->magic) || h->version != CATVERSION ||
+	    h->order != CATORDER)
+		die("%s: not a catalog of version %d", catalog, CATVERSION);
+	if (!CATFITS(h->textoff, h->textlen, 1, (uint64_t)st.st_size) ||
+	    !CATFITS(h->offoff, h->nitems, sizeof *itemoff, (uint64_t)st.st_size) ||
+	    !CATFITS(h->lenoff, h->nitems, sizeof *itemlen, (uint64_t)st.st_size) ||
+	    !CATFITS(h->maskoff, h->nitems, sizeof *itemmask, (uint64_t)st.st_size) ||
+	    (h->nitems && (!h->textlen || map[h->textoff + h->textlen - 1])))
+		die("%s: truncated catalog", catalog);
+	blob = map + h->textoff;
+	itemoff = (uint64_t *)(map + h->offoff);
+	itemlen = (uint32_t *)(map + h->lenoff);
+	itemmask = (uint64_t *)(map + h->maskoff);
+	for (i = 0; i < h->nitems; i++)
+		if (itemoff[i] >= h->textlen || itemlen[i] >= h->textlen - itemoff[i] ||
+		    blob[itemoff[i] + itemlen[i]])
+			die("%s: corrupt item %lu", catalog, (unsigned long)i);
+
+	nitems = itemsz = h->nitems;
+	itemwidth = ecalloc(MAX(nitems, 1), sizeof *itemwidth);
+	itemdist = ecalloc(MAX(nitems, 1), sizeof *itemdist);
+	itemboost = ecalloc(MAX(nitems, 1), sizeof *itemboost);
+	memset(itemboost, 0xff, nitems * sizeof *itemboost);
+	itemout = ecalloc(nitems / 64 + 1, sizeof *itemout);
+	lines = MIN(lines, nitems);
+}
+
+static void
+measureitems(size_t i)
+{
+	unsigned int adv = drw->fonts->xfont->max_advance_width;
 
+	/* widen the input field for items i and up, which is capped at a third of
+	 * the menu, skipping items too short to beat the current width */
+	for (; i < nitems && inputw < menuw / 3; i++)
+		if (itemlen[i] * adv + lrpad > inputw)
+			inputw = MIN(MAX(inputw, itemw(i)), menuw / 3);
+}
+
+static void
+readstdin(void)
+{
+	if (catalog) {
+		readcatalog();
+		return;
+	}
 	/* read each line from stdin and add it to the item list */
-	for (i = 0; fgets(buf, sizeof buf, stdin); i++) {
-		if (i + 1 >= size / sizeof *items)
-			if (!(items = realloc(items, (size += BUFSIZ))))
-				die("cannot realloc %u bytes:", size);
-		if ((p = strchr(buf, '\n')))
-			*p = '\0';
-		if (!(items[i].text = strdup(buf)))
-			die("cannot strdup %u bytes:", strlen(buf) + 1);
-		items[i].out = 0;
-		drw_font_getexts(drw->fonts, buf, strlen(buf), &tmpmax, NULL);
-		if (tmpmax > inputw) {
-			inputw = tmpmax;
-			imax = i;
+	if (!mapstdin())
+		while (ingest(STDIN_FILENO))
+			;
+	lines = MIN(lines, nitems);
+}
+
+static void
+readstream(void)
+{
+	struct timeval tv;
+	fd_set fds;
+	size_t selitem = nmatches ? matchv[sel] : (size_t)-1, nread = 0, i;
+	ssize_t n;
+
+	/* drain what is available now, but leave room for pending X events */
+	i = nitems;
+	do {
+		if ((n = ingest(STDIN_FILENO)) < 0)
+			break;
+		if (!n) {
+			streaming = 0;
+			break;
 		}
-	}
-	if (items)
-		items[i].text = NULL;
-	inputw = items ? TEXTW(items[imax].text) : 0;
-	lines = MIN(lines, i);
+		nread += n;
+
+		FD_ZERO(&fds);
+		FD_SET(STDIN_FILENO, &fds);
+		tv.tv_sec = tv.tv_usec = 0;
+	} while (nread < STREAMCHUNK && !XPending(dpy) &&
+	         select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) > 0);
+	measureitems(i);
+
+	/* re-match with the new items, keeping the selection where possible;
+	 * one pushed out of the ranked matches is dropped, as finding it would
+	 * take ranking them all */
+	pendingmatch = 0;
+	fmatch();
+	reselect(selitem);
+	frame.valid = 0;
+	drawmenu();
 }
 
 static void
 run(void)
 {
 	XEvent ev;
-
-	while (!XNextEvent(dpy, &ev)) {
+	fd_set fds;
+	int xfd = ConnectionNumber(dpy);
+
+	for (;;) {
+		if (!XPending(dpy)) {
+			/* the queue is drained, match and render once for the batch */
+			if (pendingmatch) {
+				matchnow();
+				pendingdraw = 1;
+			}
+			if (pendingdraw) {
+				pendingdraw = 0;
+				drawmenu();
+			}
+		}
+		/* multiplex stdin with the display connection until EOF */
+		if (streaming && !XPending(dpy)) {
+			FD_ZERO(&fds);
+			FD_SET(xfd, &fds);
+			FD_SET(STDIN_FILENO, &fds);
+			if (select(MAX(xfd, STDIN_FILENO) + 1, &fds, NULL, NULL, NULL) < 0) {
+				if (errno == EINTR)
+					continue;
+				die("select:");
+			}
+			if (FD_ISSET(STDIN_FILENO, &fds))
+				readstream();
+			continue;
+		}
+		if (XNextEvent(dpy, &ev))
+			break;
 		if (XFilterEvent(&ev, None))
 			continue;
 		switch(ev.type) {
 		case Expose:
-			if (ev.xexpose.count == 0)
+			if (ev.xexpose.count == 0) {
 				drw_map(drw, dmenuW, 0, 0, menuw, menuh);
+				drw_flush(drw);
+			}
 			break;
 		case FocusOut:
 			focused = 0;
-			drawmenu();
+			pendingdraw = 1;
 			break;
 		case FocusIn:
 			focused = 1;
-			drawmenu();
+			pendingdraw = 1;
 			/* regrab focus from parent window */
 			if (ev.xfocus.window != dmenuW)
 				grabfocus();
@@ -752,19 +1868,42 @@ run(void)
 						ev.xconfigure.y,
 						menuw, menuh);
 				resized = 1;
-				drawmenu();
+				frame.valid = 0;
+				pendingdraw = 1;
 			}
 			break;
 		}
 	}
 }
 
+/* Create the menu window, unmapped, and its input context, which setup()
+ * places once the options of the menu are known. */
+static void
+createwin(void)
+{
+	XSetWindowAttributes swa;
+	XIM xim;
+
+	clipA = XInternAtom(dpy, "CLIPBOARD",   False);
+	utf8A = XInternAtom(dpy, "UTF8_STRING", False);
+
+	swa.event_mask = StructureNotifyMask | ExposureMask | KeyPressMask |
+		VisibilityChangeMask | FocusChangeMask;
+	dmenuW = XCreateWindow(dpy, rootW, 0, 0, 1, 1, 0,
+	                    CopyFromParent, CopyFromParent, CopyFromParent,
+	                    CWEventMask, &swa);
+
+	/* open input methods */
+	xim = XOpenIM(dpy, NULL, NULL, NULL);
+	xic = XCreateIC(xim, XNInputStyle, XIMPreeditNothing | XIMStatusNothing,
+	                XNClientWindow, dmenuW, XNFocusWindow, dmenuW, NULL);
+}
+
 static void
 setup(void)
 {
 	int x, y, j;
 	XSetWindowAttributes swa;
-	XIM xim;
 	XWindowAttributes wa;
 	XClassHint ch = {"dmenu", "dmenu"};
 	XSizeHints *sh = NULL;
@@ -774,9 +1913,6 @@ setup(void)
 	for (j = 0; j < SchemeLast; j++)
 		scheme[j] = drw_scm_create(drw, colors[j], 2);
 
-	clipA = XInternAtom(dpy, "CLIPBOARD",   False);
-	utf8A = XInternAtom(dpy, "UTF8_STRING", False);
-
 	/* calculate menu geometry */
 	lineh = drw->fonts->h + 2;
 	lineh = MAX(lineh,linehusr);	/* make a menu line AT LEAST 'linehusr' tall */
@@ -793,7 +1929,7 @@ setup(void)
 	}
 
 	promptw = (prompt && *prompt) ? TEXTW(prompt) - lrpad / 4 : 0;
-	inputw = MIN(inputw, menuw/3);
+	measureitems(0);
 	fmatch();
 
 	/* create size hints */
@@ -803,23 +1939,14 @@ setup(void)
 	sh->width = sh->max_width = sh->min_width = menuw;
 	sh->height = sh->max_width = sh->min_width = menuh;
 
-	/* create menu window */
+	/* place the menu window, still unmapped */
 	swa.override_redirect = override_redirect ? True : False;
 	swa.background_pixel = scheme[SchemeNorm][ColBg].pixel;
-	swa.event_mask = StructureNotifyMask | ExposureMask | KeyPressMask |
-		VisibilityChangeMask | FocusChangeMask;
-	dmenuW = XCreateWindow(dpy, rootW, x, y, menuw, menuh, 0,
-	                    CopyFromParent, CopyFromParent, CopyFromParent,
-	                    CWOverrideRedirect | CWBackPixel | CWEventMask, &swa);
-	XSetClassHint(dpy, dmenuW, &ch);
+	XChangeWindowAttributes(dpy, dmenuW, CWOverrideRedirect | CWBackPixel, &swa);
+	XMoveResizeWindow(dpy, dmenuW, x, y, menuw, menuh);
 	XSetWMProperties(dpy, dmenuW, NULL, NULL, NULL, 0, sh, &wmh, &ch);
 	XFree(sh);
 
-	/* open input methods */
-	xim = XOpenIM(dpy, NULL, NULL, NULL);
-	xic = XCreateIC(xim, XNInputStyle, XIMPreeditNothing | XIMStatusNothing,
-	                XNClientWindow, dmenuW, XNFocusWindow, dmenuW, NULL);
-
 	XMapRaised(dpy, dmenuW);
 	if (override_redirect)
 		XSetInputFocus(dpy, dmenuW, RevertToParent, CurrentTime);
@@ -839,10 +1966,160 @@ hasharg(const char *arg)
 	return hash;
 }
 
-int
-main(int argc, char *argv[])
+/* Open the display, load the fonts and create the window: all that does
+ * not depend on the items. */
+static void
+warmup(void)
 {
 	XWindowAttributes wa;
+
+	if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
+		fputs("warning: no locale support\n", stderr);
+	if (!XSetLocaleModifiers(""))
+		fputs("warning: no locale modifiers support\n", stderr);
+	if (!(dpy = XOpenDisplay(NULL)))
+		die("cannot open display");
+
+	screen = DefaultScreen(dpy);
+	rootW = RootWindow(dpy, screen);
+
+	if (!XGetWindowAttributes(dpy, rootW, &wa))
+		die("could not get embedding window attributes: 0x%lx",
+		    rootW);
+
+	drw = drw_create(dpy, screen, rootW, wa.width, wa.height);
+
+	if (!drw_fontset_create(drw, fonts, (fontcount > 0 ? fontcount : 3)))
+		die("no fonts could be loaded.");
+
+	lrpad = drw->fonts->h;
+	createwin();
+}
+
+/* Serve menus on sockpath, one process each. The server keeps one warmed
+ * up in advance and returns in it once it has taken a client, with the
+ * client's working directory, standard streams and options applied. */
+static void
+serve(void)
+{
+	static char req[1 << 16];
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	union { struct cmsghdr h; char buf[CMSG_SPACE(3 * sizeof(int))]; } ctl;
+	struct iovec iov = { req, sizeof req - 1 };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct cmsghdr *c;
+	struct pollfd pfd[2];
+	struct stat st;
+	char **args, *cwd, *e, *p, taken;
+	ssize_t n;
+	int fd, ready[2], fds[3], nargs, i;
+	mode_t mask;
+	pid_t pid;
+
+	if (strlen(sockpath) >= sizeof sa.sun_path)
+		die("%s: name too long", sockpath);
+	strcpy(sa.sun_path, sockpath);
+	/* a socket left by a server that died is replaced, nothing else is */
+	if (!lstat(sockpath, &st)) {
+		if (!S_ISSOCK(st.st_mode))
+			die("%s: not a socket", sockpath);
+		if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
+			die("socket:");
+		if (!connect(fd, (struct sockaddr *)&sa, sizeof sa))
+			die("%s: already served", sockpath);
+		close(fd);
+		unlink(sockpath);
+	}
+	/* only the user may connect, a menu reads their display */
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
+		die("socket:");
+	mask = umask(077);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof sa) < 0 || listen(fd, 16) < 0)
+		die("bind %s:", sockpath);
+	umask(mask);
+	signal(SIGCHLD, SIG_IGN);
+
+	/* start the next menu as soon as one takes a client */
+	for (;;) {
+		if (pipe(ready) < 0 || (pid = fork()) < 0)
+			die("fork:");
+		if (!pid)
+			break;
+		close(ready[1]);
+		n = read(ready[0], &taken, 1);
+		close(ready[0]);
+		if (n != 1)
+			die("menu could not be warmed up");
+	}
+	close(ready[0]);
+	warmup();
+
+	/* wait for a client, unless the server goes away first */
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ready[1];
+	pfd[1].events = 0;
+	while (poll(pfd, 2, -1) < 0)
+		if (errno != EINTR)
+			die("poll:");
+	if (pfd[1].revents)
+		exit(0);
+	if ((clientfd = accept(fd, NULL, NULL)) < 0)
+		die("accept:");
+	write(ready[1], "", 1);
+	close(ready[1]);
+	close(fd);
+
+	/* the request is the client's display and locale, see clientenv, the
+	 * working directory and the options, each ended by a NUL, with the
+	 * client's stdin, stdout and stderr attached */
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof ctl.buf;
+	if ((n = recvmsg(clientfd, &msg, 0)) <= 0)
+		die("recvmsg:");
+	if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC) || !(c = CMSG_FIRSTHDR(&msg)) ||
+	    c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS ||
+	    c->cmsg_len != CMSG_LEN(sizeof fds))
+		die("bad request");
+	memcpy(fds, CMSG_DATA(c), sizeof fds);
+	req[n] = '\0';
+
+	/* a menu warmed up for another display or locale is no use, hanging up
+	 * before taking the request makes the client run dmenu itself */
+	for (i = 0, p = req; i < (int)LENGTH(clientenv); i++, p += strlen(p) + 1)
+		if (p >= req + n || strcmp(p, (e = getenv(clientenv[i])) ? e : ""))
+			exit(1);
+	if (p >= req + n || !*p)
+		die("bad request: no working directory");
+	for (i = 0; i < 3; i++) {
+		if (dup2(fds[i], i) < 0)
+			die("dup2:");
+		if (fds[i] != i)
+			close(fds[i]);
+	}
+	write(clientfd, "", 1);
+	if (chdir(p) < 0)
+		fprintf(stderr, "warning: cannot change directory to %s: %s\n", p, strerror(errno));
+
+	/* the directory takes the place of the program name */
+	for (nargs = 0, cwd = p; p < req + n; p += strlen(p) + 1)
+		nargs++;
+	args = ecalloc(nargs + 1, sizeof *args);
+	for (i = 0, p = cwd; i < nargs; p += strlen(p) + 1)
+		args[i++] = p;
+	fontcount = 0;
+	parseargs(nargs, args);
+	if (fontcount) {
+		drw_fontset_free(drw->fonts);
+		if (!drw_fontset_create(drw, fonts, fontcount))
+			die("no fonts could be loaded.");
+		lrpad = drw->fonts->h;
+	}
+}
+
+static void
+parseargs(int argc, char *argv[])
+{
 	int i;
 
 	for (i = 1; i < argc; ++i) {
@@ -856,6 +2133,11 @@ main(int argc, char *argv[])
 			case FastOpt: fast = 1; break;
 			case LinesOpt: lines = atoi(argv[++i]); break;
 			case PromptOpt: prompt = argv[++i]; break;
+			case StreamOpt: streaming = 1; break;
+			case CatalogOpt: catalog = argv[++i]; break;
+			case DaemonOpt: sockpath = argv[++i]; break;
+			case HistoryOpt: histfile = argv[++i]; break;
+			case ThreadsOpt: pool_init(atoi(argv[++i])); break;
 			case WidthOpt: menuwusr = atoi(argv[++i]); break;
 			case XOffsetOpt: menux = atoi(argv[++i]); break;
 			case YOffsetOpt: menuy = atoi(argv[++i]); break;
@@ -865,7 +2147,10 @@ main(int argc, char *argv[])
 			case SelBgOpt: colors[SchemeSel][ColBg] = argv[++i]; break;
 			case SelFgOpt: colors[SchemeSel][ColFg] = argv[++i]; break;
 			case FontOpt: fonts[fontcount++] = argv[++i]; break;
-			case CaseOpt: fstrncmp = strncasecmp; fstrstr = cistrstr; break;
+			case CaseOpt:
+				fmemcmp = cimemcmp;
+				icase = 1;
+				break;
 			case LineHeightOpt:
 				linehusr = atoi(argv[++i]);
 				linehusr = MAX(linehusr,8);
@@ -874,33 +2159,34 @@ main(int argc, char *argv[])
 				die("bad option: %s", argv[i]);
 		}
 	}
+}
 
-	if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
-		fputs("warning: no locale support\n", stderr);
-	if (!XSetLocaleModifiers(""))
-		fputs("warning: no locale modifiers support\n", stderr);
-	if (!(dpy = XOpenDisplay(NULL)))
-		die("cannot open display");
-
-	screen = DefaultScreen(dpy);
-	rootW = RootWindow(dpy, screen);
-
-	if (!XGetWindowAttributes(dpy, rootW, &wa))
-		die("could not get embedding window attributes: 0x%lx",
-		    rootW);
-
-	drw = drw_create(dpy, screen, rootW, wa.width, wa.height);
+int
+main(int argc, char *argv[])
+{
+	pool_init(sysconf(_SC_NPROCESSORS_ONLN));
+	parseargs(argc, argv);
+	if (sockpath)
+		serve();
+	else
+		warmup();
+	classifybytes();
 
-	if (!drw_fontset_create(drw, fonts, (fontcount > 0 ? fontcount : 3)))
-		die("no fonts could be loaded.");
+	if (catalog) /* a catalog is complete, there is nothing to stream */
+		streaming = 0;
+	if (histfile)
+		openhist();
 
-	lrpad = drw->fonts->h;
+	slices = ecalloc(pool_size(), sizeof *slices);
 
 	/* focus mangling when override_redirect is set */
 	if (override_redirect)
 		XGetInputFocus(dpy, &focusW, &currevert);
 
-	if (fast) {
+	if (streaming) {
+		/* map the window right away, items arrive while it runs */
+		grabkeyboard();
+	} else if (fast) {
 		grabkeyboard();
 		readstdin();
 	} else {
@@ -0,0 +1,579 @@
+/* See LICENSE file for copyright and license details. */
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arg.h"
+#include "catalog.h"
+#include "pool.h"
+#include "util.h"
+
+#define ALIGN8(X)     (((X) + 7) & ~(uint64_t)7)
+#define SCANTHREADS   32  /* most directories scanned at once */
+#define QUIETMS       100 /* wait for a burst of changes to settle */
+#define SETTLEMS      1000 /* but write at most this long after the first */
+#define RECHECKMS     1000 /* look for directories gone, back or replaced */
+#ifdef __linux__
+#define WATCHMASK     (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                       IN_DELETE_SELF | IN_MOVE_SELF | IN_MOVED_FROM | \
+                       IN_MOVED_TO | IN_ONLYDIR)
+#endif
+
+/* executables found in one directory */
+struct found {
+	char **name;
+	size_t n, sz;
+};
+
+static void add(struct found *, const char *);
+static void begin(const char *);
+static int cmpstr(const void *, const void *);
+static char *collect(size_t *);
+static void finish(const char *);
+#ifdef __linux__
+static void keep(const char *, const char *, const char *);
+static int kept(const char *);
+static long long msnow(void);
+static void onsignal(int);
+static int rewatch(int);
+#endif
+static void put(const void *, size_t, uint64_t);
+static int runnable(int, const char *, int);
+static void scanall(void);
+static void scandirs(unsigned int, size_t, size_t);
+#ifdef __linux__
+static void unwatch(int);
+static void update(int, const char *);
+static int watch(int);
+#endif
+static void usage(void);
+static void writeout(char *, size_t, const char *, const char *);
+
+char *argv0;
+
+static char tmp[PATH_MAX];
+static FILE *fp;
+static uint64_t pos;
+
+static char **dirs;
+static int ndirs;
+static struct found *found;
+static int *dirfds;                 /* -w: directories kept open, or -1 */
+#ifdef __linux__
+static int notifyfd;
+static int *watches;                /* -w: inotify watch of each directory, or -1 */
+static volatile sig_atomic_t quit;
+#endif
+
+static void
+add(struct found *f, const char *name)
+{
+	if (f->n == f->sz && !(f->name = realloc(f->name, (f->sz = MAX(2 * f->sz, 256)) * sizeof *f->name)))
+		die("cannot realloc %u bytes:", f->sz * sizeof *f->name);
+	if (!(f->name[f->n++] = strdup(name)))
+		die("strdup:");
+}
+
+/* Start writing a new file next to name, which finish() renames over it,
+ * so that readers always see a whole file. */
+static void
+begin(const char *name)
+{
+	mode_t mask;
+	int fd;
+
+	if (snprintf(tmp, sizeof tmp, "%s.XXXXXX", name) >= (int)sizeof tmp)
+		die("%s: name too long", name);
+	if ((fd = mkstemp(tmp)) < 0 || !(fp = fdopen(fd, "w")))
+		die("mkstemp %s:", tmp);
+	umask(mask = umask(0));
+	fchmod(fd, 0666 & ~mask);
+	pos = 0;
+}
+
+static int
+cmpstr(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Return the executables in the directories scanned as sorted lines, each
+ * name once, and their length in *len. */
+static char *
+collect(size_t *len)
+{
+	char **set, **uniq, *text, *name;
+	size_t setsz = 16, total = 0, nuniq = 0, i, k;
+	int d;
+
+	/* drop repeated names with a set kept at most half full */
+	for (d = 0; d < ndirs; d++)
+		total += found[d].n;
+	while (setsz < 2 * total)
+		setsz *= 2;
+	set = ecalloc(setsz, sizeof *set);
+	uniq = ecalloc(total + 1, sizeof *uniq);
+	for (d = 0; d < ndirs; d++) {
+		for (i = 0; i < found[d].n; i++) {
+			name = found[d].name[i];
+			for (k = hashtext(name, strlen(name)) & (setsz - 1);
+			     set[k] && strcmp(set[k], name); k = (k + 1) & (setsz - 1))
+				;
+			if (!set[k])
+				uniq[nuniq++] = set[k] = name;
+		}
+	}
+	qsort(uniq, nuniq, sizeof *uniq, cmpstr);
+
+	for (i = 0, *len = 0; i < nuniq; i++)
+		*len += strlen(uniq[i]) + 1;
+	text = ecalloc(*len + 1, 1);
+	for (i = 0, *len = 0; i < nuniq; i++) {
+		k = strlen(uniq[i]);
+		memcpy(text + *len, uniq[i], k);
+		text[(*len += k + 1) - 1] = '\n';
+	}
+	free(set);
+	free(uniq);
+	return text;
+}
+
+static void
+finish(const char *name)
+{
+	if (fflush(fp) || fsync(fileno(fp)) || fclose(fp) || rename(tmp, name)) {
+		unlink(tmp);
+		die("write %s:", name);
+	}
+}
+
+#ifdef __linux__
+/* Keep file and list up to date with the directories until signalled,
+ * applying each change to the entry it names. */
+static void
+keep(const char *pidfile, const char *list, const char *file)
+{
+	union { struct inotify_event ev; char buf[4096]; } u;
+	struct inotify_event *ev;
+	struct sigaction sa;
+	struct pollfd pfd;
+	struct flock lk = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+	struct stat st, cur;
+	ssize_t n;
+	char *p, *text;
+	size_t len;
+	long long now, check, first = 0, due = 0;
+	int dirty = 0, i, lockfd;
+
+	/* the lock on the pid file, held until exit, tells a running keeper
+	 * from a stale file left by a killed one */
+	for (;;) {
+		if ((lockfd = open(pidfile, O_RDWR | O_CREAT | O_CLOEXEC, 0666)) < 0)
+			die("open %s:", pidfile);
+		if (fcntl(lockfd, F_SETLK, &lk) < 0) {
+			if (errno == EACCES || errno == EAGAIN)
+				die("%s: held by another keeper", pidfile);
+			die("lock %s:", pidfile);
+		}
+		/* a keeper going away unlinks the file it held */
+		if (!fstat(lockfd, &st) && !stat(pidfile, &cur) &&
+		    st.st_dev == cur.st_dev && st.st_ino == cur.st_ino)
+			break;
+		close(lockfd);
+	}
+	if (ftruncate(lockfd, 0) < 0)
+		die("ftruncate %s:", pidfile);
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = onsignal;
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	/* watch before the first scan, so that no change falls in between */
+	if ((pfd.fd = notifyfd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) < 0)
+		die("inotify_init1:");
+	pfd.events = POLLIN;
+	watches = ecalloc(ndirs, sizeof *watches);
+	dirfds = ecalloc(ndirs, sizeof *dirfds);
+	for (i = 0; i < ndirs; i++)
+		if (!watch(i) && errno != ENOENT && errno != ENOTDIR && errno != EACCES)
+			fprintf(stderr, "warning: cannot watch %s: %s\n", dirs[i], strerror(errno));
+	scanall();
+	text = collect(&len);
+	writeout(text, len, list, file);
+	free(text);
+
+	/* the pid is only written once the files are */
+	if (dprintf(lockfd, "%d\n", (int)getpid()) < 0)
+		die("write %s:", pidfile);
+
+	for (check = msnow() + RECHECKMS; !quit; ) {
+		now = msnow();
+		/* a directory that went away is only noticed by its watch, one
+		 * that comes back or is swapped for another by looking again */
+		if (now >= check) {
+			for (i = 0; i < ndirs; i++) {
+				if (rewatch(i)) {
+					if (!dirty)
+						first = now;
+					dirty = 1;
+					due = MIN(now + QUIETMS, first + SETTLEMS);
+				}
+			}
+			check = now + RECHECKMS;
+		}
+		if (dirty && now >= due) {
+			text = collect(&len);
+			writeout(text, len, list, file);
+			free(text);
+			dirty = 0;
+		}
+		if (poll(&pfd, 1, dirty ? MIN(check, due) - now : check - now) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("poll:");
+		}
+		while ((n = read(pfd.fd, u.buf, sizeof u.buf)) > 0) {
+			for (p = u.buf; p < u.buf + n; p += sizeof *ev + ev->len) {
+				ev = (struct inotify_event *)p;
+				/* a directory changing all the time still gets written */
+				now = msnow();
+				if (!dirty)
+					first = now;
+				dirty = 1;
+				due = MIN(now + QUIETMS, first + SETTLEMS);
+				if (ev->mask & IN_Q_OVERFLOW) {
+					scanall(); /* changes were lost, read everything again */
+					continue;
+				}
+				/* the same directory may be named more than once */
+				for (i = 0; i < ndirs; i++) {
+					if (watches[i] != ev->wd)
+						continue;
+					if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+						unwatch(i);
+					else if (ev->len)
+						update(i, ev->name);
+				}
+			}
+		}
+		if (n < 0 && errno != EAGAIN && errno != EINTR)
+			die("read:");
+	}
+	if (dirty) {
+		text = collect(&len);
+		writeout(text, len, list, file);
+	}
+	unlink(pidfile);
+}
+
+/* Return whether a keeper holds pidfile and has written its files. The
+ * lock is only tested, taking it could turn away a keeper starting up. */
+static int
+kept(const char *pidfile)
+{
+	struct flock lk = { .l_type = F_RDLCK, .l_whence = SEEK_SET };
+	FILE *pf;
+	int pid = 0;
+
+	if (!(pf = fopen(pidfile, "r")))
+		return 0;
+	if (!fcntl(fileno(pf), F_GETLK, &lk) && lk.l_type != F_UNLCK &&
+	    fscanf(pf, "%d", &pid) != 1)
+		pid = 0;
+	fclose(pf);
+	return pid > 0;
+}
+
+/* Return the milliseconds on a clock that never goes back. */
+static long long
+msnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void
+onsignal(int sig)
+{
+	quit = 1;
+}
+
+/* Watch directory d again if it came back or its path now leads to
+ * another one, like a symbolic link that was swapped, and forget it if
+ * it is gone. Return whether its entries may have changed. */
+static int
+rewatch(int d)
+{
+	struct stat st, cur;
+	int had = dirfds[d] >= 0;
+
+	if (stat(dirs[d], &cur) < 0) {
+		if (had)
+			unwatch(d);
+		return had;
+	}
+	if (had && !fstat(dirfds[d], &st) &&
+	    st.st_dev == cur.st_dev && st.st_ino == cur.st_ino)
+		return 0;
+	unwatch(d);
+	watch(d);
+	if (dirfds[d] < 0)
+		return had; /* not a directory that can be read */
+	scandirs(0, d, d + 1);
+	return 1;
+}
+#endif
+
+/* Write n bytes and pad up to offset upto. */
+static void
+put(const void *p, size_t n, uint64_t upto)
+{
+	static const char pad[8];
+	size_t npad = upto - pos - n;
+
+	if (fwrite(p, 1, n, fp) != n || fwrite(pad, 1, npad, fp) != npad) {
+		unlink(tmp);
+		die("write %s:", tmp);
+	}
+	pos = upto;
+}
+
+/* Whether the entry of the directory fd is what stest -flx lists: a visible
+ * regular file that can be run. The type of the entry, unless unknown,
+ * saves following it when it leaves no doubt. */
+static int
+runnable(int fd, const char *name, int type)
+{
+	struct stat st;
+
+	return name[0] != '.' &&
+	       (type == DT_REG || type == DT_LNK || type == DT_UNKNOWN) &&
+	       (type == DT_REG || (!fstatat(fd, name, &st, 0) && S_ISREG(st.st_mode))) &&
+	       !faccessat(fd, name, X_OK, 0);
+}
+
+/* Read the executables of all directories, concurrently, each by one
+ * thread. */
+static void
+scanall(void)
+{
+	int d;
+
+	if (!found) {
+		pool_init(MIN(ndirs, SCANTHREADS));
+		found = ecalloc(ndirs, sizeof *found);
+	}
+	for (d = 0; d < ndirs; d++)
+		while (found[d].n)
+			free(found[d].name[--found[d].n]);
+	pool_run(ndirs, 1, scandirs);
+}
+
+static void
+scandirs(unsigned int slice, size_t lo, size_t hi)
+{
+	struct dirent *d;
+	DIR *dir;
+	int fd;
+
+	for (; lo < hi; lo++) {
+		if (dirfds && dirfds[lo] < 0)
+			continue;
+		if (!(dir = opendir(dirs[lo])))
+			continue;
+		fd = dirfd(dir);
+		while ((d = readdir(dir)))
+			if (runnable(fd, d->d_name, d->d_type))
+				add(&found[lo], d->d_name);
+		closedir(dir);
+	}
+}
+
+#ifdef __linux__
+/* Stop watching directory d and forget its executables. */
+static void
+unwatch(int d)
+{
+	int i;
+
+	/* the same directory named twice has one watch */
+	if (watches[d] >= 0) {
+		for (i = 0; i < ndirs && (i == d || watches[i] != watches[d]); i++)
+			;
+		if (i == ndirs)
+			inotify_rm_watch(notifyfd, watches[d]);
+		watches[d] = -1;
+	}
+	if (dirfds[d] >= 0)
+		close(dirfds[d]);
+	dirfds[d] = -1;
+	while (found[d].n)
+		free(found[d].name[--found[d].n]);
+}
+
+/* Look again at one entry of directory d after it changed. */
+static void
+update(int d, const char *name)
+{
+	struct found *f = &found[d];
+	size_t i;
+
+	for (i = 0; i < f->n && strcmp(f->name[i], name); i++)
+		;
+	if (runnable(dirfds[d], name, DT_UNKNOWN)) {
+		if (i == f->n)
+			add(f, name);
+	} else if (i < f->n) {
+		free(f->name[i]);
+		f->name[i] = f->name[--f->n];
+	}
+}
+
+/* Watch directory d and open it for reading, and return whether the
+ * watch could be added. It is read anyway if it can be opened. */
+static int
+watch(int d)
+{
+	dirfds[d] = open(dirs[d], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	return (watches[d] = inotify_add_watch(notifyfd, dirs[d], WATCHMASK)) >= 0;
+}
+#endif
+
+static void
+usage(void)
+{
+#ifdef __linux__
+	fprintf(stderr, "usage: %s [-l list] file\n"
+	        "       %s -x [-l list] [-w pidfile] file [dir...]\n"
+	        "       %s -k pidfile\n", argv0, argv0, argv0);
+#else
+	fprintf(stderr, "usage: %s [-l list] file\n"
+	        "       %s -x [-l list] file [dir...]\n", argv0, argv0);
+#endif
+	exit(1);
+}
+
+/* Write the lines of text as the catalog file, and as they are to list
+ * unless it is NULL. The text is split in place. */
+static void
+writeout(char *text, size_t len, const char *list, const char *file)
+{
+	CatHdr h = { CATMAGIC, CATVERSION, CATORDER };
+	uint64_t *off, *masks;
+	uint32_t *lens;
+	size_t n, i;
+	char *s, *p;
+
+	if (list) {
+		begin(list);
+		put(text, len, len);
+		finish(list);
+	}
+	for (n = 0, p = text; (p = memchr(p, '\n', text + len - p)); p++)
+		n++;
+
+	off = ecalloc(n + 1, sizeof *off);
+	lens = ecalloc(n + 1, sizeof *lens);
+	masks = ecalloc(n + 1, sizeof *masks);
+	for (i = 0, s = text; i < n; i++, s = p + 1) {
+		p = memchr(s, '\n', text + len - s);
+		*p = '\0';
+		off[i] = s - text;
+		lens[i] = p - s;
+		masks[i] = strmask(s, p - s);
+	}
+
+	h.nitems = n;
+	h.textoff = ALIGN8(sizeof h);
+	h.textlen = len;
+	h.offoff = ALIGN8(h.textoff + h.textlen);
+	h.lenoff = h.offoff + n * sizeof *off;
+	h.maskoff = ALIGN8(h.lenoff + n * sizeof *lens);
+
+	begin(file);
+	put(&h, sizeof h, h.textoff);
+	put(text, len, h.offoff);
+	put(off, n * sizeof *off, h.lenoff);
+	put(lens, n * sizeof *lens, h.maskoff);
+	put(masks, n * sizeof *masks, h.maskoff + n * sizeof *masks);
+	finish(file);
+	free(off);
+	free(lens);
+	free(masks);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *text = NULL, *list = NULL, *pidfile = NULL, *keptfile = NULL;
+	size_t len = 0, sz = 0, n;
+	int scan = 0;
+
+	ARGBEGIN {
+	case 'l': /* also write the items as lines */
+		list = EARGF(usage());
+		break;
+#ifdef __linux__
+	case 'k': /* only tell whether a keeper runs */
+		keptfile = EARGF(usage());
+		break;
+	case 'w': /* keep the files up to date with the directories */
+		pidfile = EARGF(usage());
+		break;
+#endif
+	case 'x': /* executables in the directories */
+		scan = 1;
+		break;
+	default:
+		usage();
+	} ARGEND;
+#ifdef __linux__
+	if (keptfile)
+		return !kept(keptfile);
+#endif
+	if (argc < 1 || (!scan && argc != 1) || (pidfile && !scan))
+		usage();
+
+	if (scan) {
+		dirs = argv + 1;
+		ndirs = argc - 1;
+#ifdef __linux__
+		if (pidfile) {
+			keep(pidfile, list, argv[0]);
+			return 0;
+		}
+#endif
+		scanall();
+		text = collect(&len);
+	} else {
+		/* read the items, one per line */
+		do {
+			if (sz - len < BUFSIZ && !(text = realloc(text, sz = MAX(2 * sz, BUFSIZ))))
+				die("cannot realloc %u bytes:", sz);
+			len += (n = fread(text + len, 1, sz - len, stdin));
+		} while (n);
+		if (ferror(stdin))
+			die("read:");
+		if (len && text[len - 1] != '\n')
+			text[len++] = '\n';
+	}
+	writeout(text, len, list, argv[0]);
+	return 0;
+}
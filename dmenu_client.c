@@ -0,0 +1,85 @@
+/* See LICENSE file for copyright and license details. */
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "util.h"
+
+static char req[1 << 16];
+static size_t reqlen;
+
+static void
+add(const char *s)
+{
+	size_t n = strlen(s) + 1;
+
+	if (n > sizeof req - reqlen)
+		die("options too long");
+	memcpy(req + reqlen, s, n);
+	reqlen += n;
+}
+
+/* no server for this menu, show it the slow way */
+static void
+fallback(char *argv[])
+{
+	argv[1] = "dmenu";
+	execvp(argv[1], argv + 1);
+	die("exec dmenu:");
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	union { struct cmsghdr h; char buf[CMSG_SPACE(3 * sizeof(int))]; } ctl;
+	struct iovec iov = { req, 0 };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct cmsghdr *c;
+	int fd, fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO }, i;
+	unsigned char status;
+	char cwd[PATH_MAX], *e;
+
+	if (argc < 2)
+		die("usage: dmenu_client socket [option ...]");
+	if (strlen(argv[1]) >= sizeof sa.sun_path)
+		die("%s: name too long", argv[1]);
+	strcpy(sa.sun_path, argv[1]);
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0 ||
+	    connect(fd, (struct sockaddr *)&sa, sizeof sa) < 0)
+		fallback(argv);
+
+	/* the display and locale, the working directory and the options, each
+	 * ended by a NUL */
+	for (i = 0; i < (int)LENGTH(clientenv); i++)
+		add((e = getenv(clientenv[i])) ? e : "");
+	if (!getcwd(cwd, sizeof cwd))
+		die("getcwd:");
+	add(cwd);
+	for (i = 2; i < argc; i++)
+		add(argv[i]);
+	iov.iov_len = reqlen;
+
+	/* the menu reads and writes the standard streams directly */
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof ctl.buf;
+	c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(sizeof fds);
+	memcpy(CMSG_DATA(c), fds, sizeof fds);
+	/* it takes the request with a byte, or hangs up when it cannot show
+	 * this menu, then answers with its exit status */
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0 || read(fd, &status, 1) != 1) {
+		close(fd);
+		fallback(argv);
+	}
+	return read(fd, &status, 1) == 1 ? status : 1;
+}
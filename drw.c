@@ -1,4 +1,5 @@
 /* See LICENSE file for copyright and license details. */
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +10,11 @@
 #include "util.h"
 #include "utf8.h"
 
+#define FALLBACKMAX 16 /* fallback fonts appended to a fontset at most */
+
+static Fnt nofont; /* marks codepoints no font could be found for */
+
+static void fontcov_put(Drw *drw, long cp, Fnt *font);
 
 Drw *
 drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h)
@@ -21,6 +27,8 @@ drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h
 	drw->w = w;
 	drw->h = h;
 	drw->drawable = XCreatePixmap(dpy, root, w, h, DefaultDepth(dpy, screen));
+	drw->xftdraw = XftDrawCreate(dpy, drw->drawable, DefaultVisual(dpy, screen),
+	                             DefaultColormap(dpy, screen));
 	drw->gc = XCreateGC(dpy, root, 0, NULL);
 	XSetLineAttributes(dpy, drw->gc, 1, LineSolid, CapButt, JoinMiter);
 
@@ -30,19 +38,32 @@ drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h
 void
 drw_resize(Drw *drw, unsigned int w, unsigned int h)
 {
+	Drawable old;
+
 	if (!drw)
 		return;
 
+	old = drw->drawable;
 	drw->w = w;
 	drw->h = h;
-	if (drw->drawable)
-		XFreePixmap(drw->dpy, drw->drawable);
 	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
+	/* rebind the XftDraw before the pixmap it renders to goes away */
+	if (drw->xftdraw)
+		XftDrawChange(drw->xftdraw, drw->drawable);
+	else
+		drw->xftdraw = XftDrawCreate(drw->dpy, drw->drawable,
+		                             DefaultVisual(drw->dpy, drw->screen),
+		                             DefaultColormap(drw->dpy, drw->screen));
+	if (old)
+		XFreePixmap(drw->dpy, old);
 }
 
 void
 drw_free(Drw *drw)
 {
+	free(drw->bmpcov);
+	free(drw->cov);
+	XftDrawDestroy(drw->xftdraw);
 	XFreePixmap(drw->dpy, drw->drawable);
 	XFreeGC(drw->dpy, drw->gc);
 	free(drw);
@@ -91,6 +112,97 @@ xfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern)
 	return font;
 }
 
+/* Forget which fonts cover which codepoints. Only needed when the fontset
+ * is replaced: appending a fallback font never changes the first font
+ * covering a codepoint that was already resolved. */
+static void
+fontcov_clear(Drw *drw)
+{
+	free(drw->bmpcov);
+	free(drw->cov);
+	drw->bmpcov = NULL;
+	drw->cov = NULL;
+	drw->ncov = drw->covsz = 0;
+}
+
+/* A newly appended fallback font may cover codepoints that were missing. */
+static void
+fontcov_dropmisses(Drw *drw)
+{
+	FntCov *old = drw->cov;
+	size_t i, oldsz = drw->covsz;
+
+	if (drw->bmpcov)
+		for (i = 0; i < 0x10000; i++)
+			if (drw->bmpcov[i] == &nofont)
+				drw->bmpcov[i] = NULL;
+	/* rehash, removing entries from an open addressing table breaks probing */
+	drw->cov = NULL;
+	drw->ncov = drw->covsz = 0;
+	for (i = 0; i < oldsz; i++)
+		if (old[i].font && old[i].font != &nofont)
+			fontcov_put(drw, old[i].cp, old[i].font);
+	free(old);
+}
+
+static void
+fontcov_put(Drw *drw, long cp, Fnt *font)
+{
+	FntCov *old;
+	size_t i, oldsz;
+
+	if (cp < 0x10000) {
+		if (!drw->bmpcov)
+			drw->bmpcov = ecalloc(0x10000, sizeof(Fnt *));
+		drw->bmpcov[cp] = font;
+		return;
+	}
+	if (2 * (drw->ncov + 1) > drw->covsz) {
+		old = drw->cov;
+		oldsz = drw->covsz;
+		drw->covsz = oldsz ? oldsz * 2 : 64;
+		drw->cov = ecalloc(drw->covsz, sizeof(FntCov));
+		drw->ncov = 0;
+		for (i = 0; i < oldsz; i++)
+			if (old[i].font)
+				fontcov_put(drw, old[i].cp, old[i].font);
+		free(old);
+	}
+	for (i = cp & (drw->covsz - 1); drw->cov[i].font; i = (i + 1) & (drw->covsz - 1))
+		;
+	drw->cov[i].cp = cp;
+	drw->cov[i].font = font;
+	drw->ncov++;
+}
+
+/* Return the first font of the set that covers cp, the first font of the
+ * set if no fallback could be found for cp before, or NULL. */
+static Fnt *
+fontcov_get(Drw *drw, long cp)
+{
+	Fnt *font = NULL;
+	size_t i;
+
+	if (cp < 0x10000) {
+		if (drw->bmpcov)
+			font = drw->bmpcov[cp];
+	} else if (drw->covsz) {
+		for (i = cp & (drw->covsz - 1); drw->cov[i].font; i = (i + 1) & (drw->covsz - 1))
+			if (drw->cov[i].cp == cp) {
+				font = drw->cov[i].font;
+				break;
+			}
+	}
+	if (font)
+		return font == &nofont ? drw->fonts : font;
+	for (font = drw->fonts; font; font = font->next)
+		if (XftCharExists(drw->dpy, font->xfont, cp)) {
+			fontcov_put(drw, cp, font);
+			return font;
+		}
+	return NULL;
+}
+
 static void
 xfont_free(Fnt *font)
 {
@@ -117,6 +229,9 @@ drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 			ret = cur;
 		}
 	}
+	drw->fontgen++;
+	drw->nfallback = 0;
+	fontcov_clear(drw);
 	return (drw->fonts = ret);
 }
 
@@ -161,8 +276,12 @@ drw_scm_create(Drw *drw, const char *clrnames[], size_t clrcount)
 void
 drw_setfontset(Drw *drw, Fnt *set)
 {
-	if (drw)
+	if (drw) {
 		drw->fonts = set;
+		drw->fontgen++;
+		drw->nfallback = 0;
+		fontcov_clear(drw);
+	}
 }
 
 void
@@ -184,15 +303,43 @@ drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int
 		XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w - 1, h - 1);
 }
 
+/* Return the length of the longest prefix of text[0..len) that ends on a
+ * rune boundary and is at most w wide, found by bisection. Its width is
+ * stored in ew. */
+static size_t
+font_fit(Fnt *font, const char *text, size_t len, unsigned int w, unsigned int *ew)
+{
+	size_t lo = 0, hi = len, mid;
+	unsigned int midw;
+
+	*ew = 0;
+	while (hi - lo > 1) {
+		for (mid = lo + (hi - lo) / 2; mid > lo && (text[mid] & 0xc0) == 0x80; mid--)
+			;
+		if (mid == lo)
+			for (mid = lo + 1; mid < hi && (text[mid] & 0xc0) == 0x80; mid++)
+				;
+		if (mid == hi)
+			break;
+		drw_font_getexts(font, text, mid, &midw, NULL);
+		if (midw <= w) {
+			lo = mid;
+			*ew = midw;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
 int
 drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert)
 {
 	char buf[1024];
 	int ty;
 	unsigned int ew;
-	XftDraw *d = NULL;
 	Fnt *usedfont, *curfont, *nextfont;
-	size_t i, len;
+	size_t i, n, len;
 	int utf8strlen, utf8charlen, render = x || y || w || h;
 	long utf8codepoint = 0;
 	const char *utf8str;
@@ -210,9 +357,6 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 	} else {
 		XSetForeground(drw->dpy, drw->gc, drw->scheme[invert ? ColFg : ColBg].pixel);
 		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-		d = XftDrawCreate(drw->dpy, drw->drawable,
-		                  DefaultVisual(drw->dpy, drw->screen),
-		                  DefaultColormap(drw->dpy, drw->screen));
 		x += lpad;
 		w -= lpad;
 	}
@@ -224,16 +368,16 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 		nextfont = NULL;
 		while (*text) {
 			utf8charlen = utf8decode(text, &utf8codepoint);
-			for (curfont = drw->fonts; curfont; curfont = curfont->next) {
-				charexists = charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint);
-				if (charexists) {
-					if (curfont == usedfont) {
-						utf8strlen += utf8charlen;
-						text += utf8charlen;
-					} else {
-						nextfont = curfont;
-					}
-					break;
+			if (charexists)
+				curfont = drw->fonts;
+			else if ((curfont = fontcov_get(drw, utf8codepoint)))
+				charexists = 1;
+			if (charexists) {
+				if (curfont == usedfont) {
+					utf8strlen += utf8charlen;
+					text += utf8charlen;
+				} else {
+					nextfont = curfont;
 				}
 			}
 
@@ -244,21 +388,29 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 		}
 
 		if (utf8strlen) {
-			drw_font_getexts(usedfont, utf8str, utf8strlen, &ew, NULL);
 			/* shorten text if necessary */
-			for (len = MIN(utf8strlen, sizeof(buf) - 1); len && ew > w; len--)
-				drw_font_getexts(usedfont, utf8str, len, &ew, NULL);
+			len = MIN(utf8strlen, sizeof(buf) - 1);
+			while (len < utf8strlen && len && (utf8str[len] & 0xc0) == 0x80)
+				len--;
+			drw_font_getexts(usedfont, utf8str, len, &ew, NULL);
+			if (ew > w)
+				len = font_fit(usedfont, utf8str, len, w, &ew);
 
 			if (len) {
 				memcpy(buf, utf8str, len);
 				buf[len] = '\0';
-				if (len < utf8strlen)
-					for (i = len; i && i > len - 3; buf[--i] = '.')
-						; /* NOP */
+				if (len < utf8strlen) {
+					/* replace up to three trailing runes by dots */
+					for (i = len, n = 0; i && n < 3; n++)
+						while (--i && (buf[i] & 0xc0) == 0x80)
+							; /* NOP */
+					memset(buf + i, '.', n);
+					len = i + n;
+				}
 
 				if (render) {
 					ty = y + (h - usedfont->h) / 2 + usedfont->xfont->ascent;
-					XftDrawStringUtf8(d, &drw->scheme[invert ? ColBg : ColFg],
+					XftDrawStringUtf8(drw->xftdraw, &drw->scheme[invert ? ColBg : ColFg],
 					                  usedfont->xfont, x, ty, (XftChar8 *)buf, len);
 				}
 				x += ew;
@@ -276,14 +428,21 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 			 * character must be drawn. */
 			charexists = 1;
 
-			fccharset = FcCharSetCreate();
-			FcCharSetAddChar(fccharset, utf8codepoint);
-
 			if (!drw->fonts->pattern) {
 				/* Refer to the comment in xfont_create for more information. */
 				die("the first font in the cache must be loaded from a font string.");
 			}
 
+			/* ask fontconfig only once per codepoint and for a bounded
+			 * number of fallback fonts */
+			if (drw->nfallback >= FALLBACKMAX) {
+				fontcov_put(drw, utf8codepoint, &nofont);
+				continue;
+			}
+
+			fccharset = FcCharSetCreate();
+			FcCharSetAddChar(fccharset, utf8codepoint);
+
 			fcpattern = FcPatternDuplicate(drw->fonts->pattern);
 			FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
 			FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
@@ -301,16 +460,18 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 					for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
 						; /* NOP */
 					curfont->next = usedfont;
+					drw->nfallback++;
+					fontcov_dropmisses(drw);
 				} else {
 					xfont_free(usedfont);
 					usedfont = drw->fonts;
+					fontcov_put(drw, utf8codepoint, &nofont);
 				}
+			} else {
+				fontcov_put(drw, utf8codepoint, &nofont);
 			}
 		}
 	}
-	if (d)
-		XftDrawDestroy(d);
-
 	return x + (render ? w : 0);
 }
 
@@ -321,7 +482,21 @@ drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
 		return;
 
 	XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
+}
+
+/* Hand a finished frame to the server. Waiting for it to be processed is
+ * only done when built with SYNCFRAMES, to compare latencies. */
+void
+drw_flush(Drw *drw)
+{
+	if (!drw)
+		return;
+
+#ifdef SYNCFRAMES
 	XSync(drw->dpy, False);
+#else
+	XFlush(drw->dpy);
+#endif
 }
 
 unsigned int
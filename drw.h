@@ -12,6 +12,11 @@ typedef struct Fnt {
 	struct Fnt *next;
 } Fnt;
 
+typedef struct {
+	long cp;
+	Fnt *font;
+} FntCov; /* codepoint outside the BMP and the first font covering it */
+
 enum { ColFg, ColBg }; /* Clr scheme index */
 typedef XftColor Clr;
 
@@ -21,9 +26,15 @@ typedef struct {
 	int screen;
 	Window root;
 	Drawable drawable;
+	XftDraw *xftdraw;
 	GC gc;
 	Clr *scheme;
 	Fnt *fonts;
+	unsigned int fontgen; /* bumped whenever the fontset is replaced */
+	Fnt **bmpcov;         /* first font covering each BMP codepoint */
+	FntCov *cov;          /* open addressing table for other codepoints */
+	size_t ncov, covsz;
+	unsigned int nfallback; /* fallback fonts appended to the set */
 } Drw;
 
 /* Drawable abstraction */
@@ -55,3 +66,4 @@ int drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned in
 
 /* Map functions */
 void drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h);
+void drw_flush(Drw *drw);
@@ -0,0 +1,106 @@
+/* See LICENSE file for copyright and license details. */
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
+#include "util.h"
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t startcv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t donecv = PTHREAD_COND_INITIALIZER;
+
+static pthread_t *threads;
+static unsigned int nthreads = 1; /* including the calling thread */
+static unsigned int started;      /* worker threads running */
+static unsigned int gen, done, nslices;
+static size_t total;
+static PoolJob curjob;
+
+static void
+slice_run(unsigned int slice)
+{
+	curjob(slice, total * slice / nslices, total * (slice + 1) / nslices);
+}
+
+static void *
+worker(void *arg)
+{
+	unsigned int slice = (unsigned int)(size_t)arg, seen = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&mtx);
+		while (gen == seen)
+			pthread_cond_wait(&startcv, &mtx);
+		seen = gen;
+		pthread_mutex_unlock(&mtx);
+
+		if (slice < nslices)
+			slice_run(slice);
+
+		pthread_mutex_lock(&mtx);
+		if (++done == started)
+			pthread_cond_signal(&donecv);
+		pthread_mutex_unlock(&mtx);
+	}
+	return NULL;
+}
+
+/* Set the number of threads jobs are split across, the calling thread
+ * included. Workers are only started by the first parallel run. */
+void
+pool_init(int n)
+{
+	if (!started)
+		nthreads = MAX(n, 1);
+}
+
+unsigned int
+pool_size(void)
+{
+	return nthreads;
+}
+
+/* Run job over [0, n) split into contiguous slices, in order of their
+ * index, and wait for all of them. Ranges shorter than min run serially
+ * as slice 0. Returns the number of slices used. */
+unsigned int
+pool_run(size_t n, size_t min, PoolJob job)
+{
+	unsigned int i;
+
+	if (nthreads < 2 || n < min) {
+		job(0, 0, n);
+		return 1;
+	}
+	if (!threads) {
+		threads = ecalloc(nthreads - 1, sizeof *threads);
+		for (i = 1; i < nthreads; i++)
+			if (pthread_create(&threads[i - 1], NULL, worker, (void *)(size_t)i))
+				break;
+		started = i - 1;
+		if (!started) {
+			nthreads = 1;
+			job(0, 0, n);
+			return 1;
+		}
+	}
+
+	pthread_mutex_lock(&mtx);
+	curjob = job;
+	total = n;
+	nslices = started + 1;
+	done = 0;
+	gen++;
+	pthread_cond_broadcast(&startcv);
+	pthread_mutex_unlock(&mtx);
+
+	slice_run(0);
+
+	pthread_mutex_lock(&mtx);
+	while (done < started)
+		pthread_cond_wait(&donecv, &mtx);
+	pthread_mutex_unlock(&mtx);
+
+	return nslices;
+}
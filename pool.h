@@ -0,0 +1,8 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Job run by the pool on the index range [lo, hi) of slice number slice. */
+typedef void (*PoolJob)(unsigned int slice, size_t lo, size_t hi);
+
+void pool_init(int nthreads);
+unsigned int pool_size(void);
+unsigned int pool_run(size_t n, size_t min, PoolJob job);
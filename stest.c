@@ -2,7 +2,7 @@
 #include <sys/stat.h>
 
 #include <dirent.h>
-#include <limits.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,34 +13,44 @@ char *argv0;
 
 #define FLAG(x)  (flag[(x)-'a'])
 
-static void test(const char *, const char *);
+static void test(int, const char *, const char *, int);
 static void usage(void);
 
 static int match = 0;
 static int flag[26];
 static struct stat old, new;
 
+/* Test path relative to the directory fd, printing name if it passes.
+ * The directory entry type, unless DT_UNKNOWN, stands in for stat() when
+ * no other field of it is asked for. */
 static void
-test(const char *path, const char *name)
+test(int fd, const char *path, const char *name, int type)
 {
 	struct stat st, ln;
+	int known = type != DT_UNKNOWN && type != DT_LNK;
 
-	if ((!stat(path, &st) && (FLAG('a') || name[0] != '.')        /* hidden files      */
-	&& (!FLAG('b') || S_ISBLK(st.st_mode))                        /* block special     */
-	&& (!FLAG('c') || S_ISCHR(st.st_mode))                        /* character special */
-	&& (!FLAG('d') || S_ISDIR(st.st_mode))                        /* directory         */
-	&& (!FLAG('e') || access(path, F_OK) == 0)                    /* exists            */
-	&& (!FLAG('f') || S_ISREG(st.st_mode))                        /* regular file      */
-	&& (!FLAG('g') || st.st_mode & S_ISGID)                       /* set-group-id flag */
-	&& (!FLAG('h') || (!lstat(path, &ln) && S_ISLNK(ln.st_mode))) /* symbolic link     */
-	&& (!FLAG('n') || st.st_mtime > new.st_mtime)                 /* newer than file   */
-	&& (!FLAG('o') || st.st_mtime < old.st_mtime)                 /* older than file   */
-	&& (!FLAG('p') || S_ISFIFO(st.st_mode))                       /* named pipe        */
-	&& (!FLAG('r') || access(path, R_OK) == 0)                    /* readable          */
-	&& (!FLAG('s') || st.st_size > 0)                             /* not empty         */
-	&& (!FLAG('u') || st.st_mode & S_ISUID)                       /* set-user-id flag  */
-	&& (!FLAG('w') || access(path, W_OK) == 0)                    /* writable          */
-	&& (!FLAG('x') || access(path, X_OK) == 0)) != FLAG('v')) {   /* executable        */
+	if (known && !FLAG('g') && !FLAG('n') && !FLAG('o') && !FLAG('s') && !FLAG('u'))
+		st.st_mode = DTTOIF(type);
+	else if (fstatat(fd, path, &st, 0))
+		known = -1;
+
+	if ((known >= 0 && (FLAG('a') || name[0] != '.')                    /* hidden files      */
+	&& (!FLAG('b') || S_ISBLK(st.st_mode))                              /* block special     */
+	&& (!FLAG('c') || S_ISCHR(st.st_mode))                              /* character special */
+	&& (!FLAG('d') || S_ISDIR(st.st_mode))                              /* directory         */
+	&& (!FLAG('e') || faccessat(fd, path, F_OK, 0) == 0)                /* exists            */
+	&& (!FLAG('f') || S_ISREG(st.st_mode))                              /* regular file      */
+	&& (!FLAG('g') || st.st_mode & S_ISGID)                             /* set-group-id flag */
+	&& (!FLAG('h') || (type != DT_UNKNOWN ? type == DT_LNK :
+	    !fstatat(fd, path, &ln, AT_SYMLINK_NOFOLLOW) && S_ISLNK(ln.st_mode))) /* symbolic link */
+	&& (!FLAG('n') || st.st_mtime > new.st_mtime)                       /* newer than file   */
+	&& (!FLAG('o') || st.st_mtime < old.st_mtime)                       /* older than file   */
+	&& (!FLAG('p') || S_ISFIFO(st.st_mode))                             /* named pipe        */
+	&& (!FLAG('r') || faccessat(fd, path, R_OK, 0) == 0)                /* readable          */
+	&& (!FLAG('s') || st.st_size > 0)                                   /* not empty         */
+	&& (!FLAG('u') || st.st_mode & S_ISUID)                             /* set-user-id flag  */
+	&& (!FLAG('w') || faccessat(fd, path, W_OK, 0) == 0)                /* writable          */
+	&& (!FLAG('x') || faccessat(fd, path, X_OK, 0) == 0)) != FLAG('v')) { /* executable        */
 		if (FLAG('q'))
 			exit(0);
 		match = 1;
@@ -60,11 +70,10 @@ int
 main(int argc, char *argv[])
 {
 	struct dirent *d;
-	char path[PATH_MAX], *line = NULL, *file;
+	char *line = NULL, *file;
 	size_t linesiz = 0;
 	ssize_t n;
 	DIR *dir;
-	int r;
 
 	ARGBEGIN {
 	case 'n': /* newer than file */
@@ -86,22 +95,18 @@ main(int argc, char *argv[])
 		while ((n = getline(&line, &linesiz, stdin)) > 0) {
 			if (n && line[n - 1] == '\n')
 				line[n - 1] = '\0';
-			test(line, line);
+			test(AT_FDCWD, line, line, DT_UNKNOWN);
 		}
 		free(line);
 	} else {
 		for (; argc; argc--, argv++) {
 			if (FLAG('l') && (dir = opendir(*argv))) {
-				/* test directory contents */
-				while ((d = readdir(dir))) {
-					r = snprintf(path, sizeof path, "%s/%s",
-					             *argv, d->d_name);
-					if (r >= 0 && (size_t)r < sizeof path)
-						test(path, d->d_name);
-				}
+				/* test directory contents, relative to it */
+				while ((d = readdir(dir)))
+					test(dirfd(dir), d->d_name, d->d_name, d->d_type);
 				closedir(dir);
 			} else {
-				test(*argv, *argv);
+				test(AT_FDCWD, *argv, *argv, DT_UNKNOWN);
 			}
 		}
 	}
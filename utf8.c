@@ -4,6 +4,7 @@
  */
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include "util.h" // TODO: question the necessity of the BETWEEN macro
 
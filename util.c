@@ -1,21 +1,49 @@
 /* See LICENSE file for copyright and license details. */
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #include "util.h"
 
-char *
-cistrstr(const char *s, const char *sub)
+/* Return the first occurrence of byte a or byte b in [s, end), or NULL.
+ * Comparing 16 or 32 bytes at a time where the CPU allows it. */
+const char *
+findbyte(const char *s, const char *end, char a, char b)
 {
-	size_t len;
+#ifdef __AVX2__
+	__m256i a32 = _mm256_set1_epi8(a), b32 = _mm256_set1_epi8(b), v32;
+	unsigned int m32;
 
-	for (len = strlen(sub); *s; ++s) {
-		if (!strncasecmp(s, sub, len))
-			return (char *) s;
+	for (; end - s >= 32; s += 32) {
+		v32 = _mm256_loadu_si256((const __m256i *)s);
+		if ((m32 = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v32, a32),
+		                                                _mm256_cmpeq_epi8(v32, b32)))))
+			return s + __builtin_ctz(m32);
 	}
+#endif
+#ifdef __SSE2__
+	__m128i a16 = _mm_set1_epi8(a), b16 = _mm_set1_epi8(b), v16;
+	unsigned int m16;
+
+	for (; end - s >= 16; s += 16) {
+		v16 = _mm_loadu_si128((const __m128i *)s);
+		if ((m16 = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v16, a16),
+		                                          _mm_cmpeq_epi8(v16, b16)))))
+			return s + __builtin_ctz(m16);
+	}
+#endif
+	for (; s < end; s++)
+		if (*s == a || *s == b)
+			return s;
 
 	return NULL;
 }
@@ -47,3 +75,146 @@ die(const char *fmt, ...) {
 
 	exit(1);
 }
+
+/* Compare n bytes like memcmp(), ignoring ASCII case as strncasecmp() does
+ * in the C locale, without its per-byte locale lookups. */
+int
+cimemcmp(const void *a, const void *b, size_t n)
+{
+	const unsigned char *p = a, *q = b;
+
+	for (; n; n--, p++, q++)
+		if (FOLD(*p) != FOLD(*q))
+			return FOLD(*p) - FOLD(*q);
+	return 0;
+}
+
+/* Prepare a search for the len bytes of sub, which scans for its bytes at
+ * offsets i and j in either case if icase is set. The rarer those bytes
+ * are in the text searched, the fewer places are compared in full. */
+void
+mkneedle(Needle *n, const char *sub, size_t len, size_t i, size_t j, int icase)
+{
+	n->s = sub;
+	n->len = len;
+	n->i = i;
+	n->j = j;
+	n->icase = icase;
+	n->ia = icase ? FOLD((unsigned char)sub[i]) : sub[i];
+	n->ib = icase ? UNFOLD((unsigned char)sub[i]) : sub[i];
+	n->ja = icase ? FOLD((unsigned char)sub[j]) : sub[j];
+	n->jb = icase ? UNFOLD((unsigned char)sub[j]) : sub[j];
+}
+
+/* Return the first occurrence of the needle in [s, end), or NULL. Places
+ * holding both of its scanned bytes are found 16 or 32 at a time where
+ * the CPU allows it, so ignoring case costs about the same. */
+const char *
+findneedle(const Needle *n, const char *s, const char *end)
+{
+	int (*cmp)(const void *, const void *, size_t) = n->icase ? cimemcmp : memcmp;
+	unsigned int m;
+#ifdef __AVX2__
+	__m256i ia32, ib32, ja32, jb32, v32, w32;
+#endif
+#ifdef __SSE2__
+	__m128i ia16, ib16, ja16, jb16, v16, w16;
+#endif
+
+	if (!n->len)
+		return s;
+	if ((size_t)(end - s) < n->len)
+		return NULL;
+	end -= n->len - 1; /* past the last place the needle can start */
+
+#ifdef __AVX2__
+	if (end - s >= 32) {
+		ia32 = _mm256_set1_epi8(n->ia);
+		ib32 = _mm256_set1_epi8(n->ib);
+		ja32 = _mm256_set1_epi8(n->ja);
+		jb32 = _mm256_set1_epi8(n->jb);
+		/* the last block overlaps the one before instead of a byte loop */
+		for (;; s = MIN(s + 32, end - 32)) {
+			v32 = _mm256_loadu_si256((const __m256i *)(s + n->i));
+			w32 = _mm256_loadu_si256((const __m256i *)(s + n->j));
+			m = _mm256_movemask_epi8(_mm256_and_si256(
+			        _mm256_or_si256(_mm256_cmpeq_epi8(v32, ia32), _mm256_cmpeq_epi8(v32, ib32)),
+			        _mm256_or_si256(_mm256_cmpeq_epi8(w32, ja32), _mm256_cmpeq_epi8(w32, jb32))));
+			for (; m; m &= m - 1)
+				if (!cmp(s + __builtin_ctz(m), n->s, n->len))
+					return s + __builtin_ctz(m);
+			if (end - s <= 32)
+				return NULL;
+		}
+	}
+#endif
+#ifdef __SSE2__
+	if (end - s >= 16) {
+		ia16 = _mm_set1_epi8(n->ia);
+		ib16 = _mm_set1_epi8(n->ib);
+		ja16 = _mm_set1_epi8(n->ja);
+		jb16 = _mm_set1_epi8(n->jb);
+		for (;; s = MIN(s + 16, end - 16)) {
+			v16 = _mm_loadu_si128((const __m128i *)(s + n->i));
+			w16 = _mm_loadu_si128((const __m128i *)(s + n->j));
+			m = _mm_movemask_epi8(_mm_and_si128(
+			        _mm_or_si128(_mm_cmpeq_epi8(v16, ia16), _mm_cmpeq_epi8(v16, ib16)),
+			        _mm_or_si128(_mm_cmpeq_epi8(w16, ja16), _mm_cmpeq_epi8(w16, jb16))));
+			for (; m; m &= m - 1)
+				if (!cmp(s + __builtin_ctz(m), n->s, n->len))
+					return s + __builtin_ctz(m);
+			if (end - s <= 16)
+				return NULL;
+		}
+	}
+#endif
+	for (; s < end; s++)
+		if ((s[n->i] == n->ia || s[n->i] == n->ib) &&
+		    (s[n->j] == n->ja || s[n->j] == n->jb) && !cmp(s, n->s, n->len))
+			return s;
+	return NULL;
+}
+
+/* Map a byte to one of 64 classes: folded letters, digits, and the rest
+ * of ASCII and all non-ASCII bytes sharing the remaining bits. Catalogs
+ * store these, a change needs a new CATVERSION. */
+static uint64_t
+charmask(unsigned char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		c += 'a' - 'A';
+	if (c >= 'a' && c <= 'z')
+		return 1ULL << (c - 'a');
+	if (c >= '0' && c <= '9')
+		return 1ULL << (26 + c - '0');
+	if (c >= 0x80)
+		return 1ULL << 63;
+	return 1ULL << (36 + c % 27);
+}
+
+/* Return the classes of the len bytes of s, see charmask(). */
+uint64_t
+strmask(const char *s, size_t len)
+{
+	static uint64_t tab[256];
+	uint64_t mask = 0;
+	size_t i;
+
+	if (!tab['a'])
+		for (i = 0; i < 256; i++)
+			tab[i] = charmask(i);
+	for (i = 0; i < len; i++)
+		mask |= tab[(unsigned char)s[i]];
+	return mask;
+}
+
+/* Return the FNV-1a hash of the len bytes of s, never 0. */
+uint64_t
+hashtext(const char *s, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	while (len--)
+		h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+	return h ? h : 1;
+}
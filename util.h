@@ -3,8 +3,24 @@
 #define MAX(A, B)               ((A) > (B) ? (A) : (B))
 #define MIN(A, B)               ((A) < (B) ? (A) : (B))
 #define BETWEEN(X, A, B)        ((A) <= (X) && (X) <= (B))
+#define LENGTH(X)               (sizeof X / sizeof X[0])
+#define FOLD(C)                 (BETWEEN((C), 'A', 'Z') ? (C) | 0x20 : (C))
+#define UNFOLD(C)               (BETWEEN((C), 'a', 'z') ? (C) & ~0x20 : (C))
+
+typedef struct {
+	const char *s;
+	size_t len;
+	size_t i, j;         /* offsets of the bytes scanned for */
+	char ia, ib, ja, jb; /* those bytes in either case */
+	int icase;
+} Needle;
 
 void die(const char *fmt, ...);
 void *ecalloc(size_t nmemb, size_t size);
 
-char *cistrstr(const char *, const char *);
+int cimemcmp(const void *, const void *, size_t);
+uint64_t strmask(const char *, size_t);
+uint64_t hashtext(const char *, size_t);
+const char *findbyte(const char *, const char *, char, char);
+void mkneedle(Needle *, const char *, size_t, size_t, size_t, int);
+const char *findneedle(const Needle *, const char *, const char *);